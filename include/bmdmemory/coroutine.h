@@ -0,0 +1,276 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#if __cplusplus < 202002L
+#error "bmdmemory/coroutine.h requires C++20"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "bmdmemory/reader.h"
+
+// awaitable reader for coroutines, any number of consumers share one mapping of the segment and the thread that calls run
+// the reader claims no cursor, so the consumers never hold the writer back
+namespace bmdmemory
+{
+    // coroutine that starts right away and destroys itself when it finishes
+    struct Task
+    {
+        struct promise_type
+        {
+            Task get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    class AsyncReader
+    {
+    private:
+        struct Waiter
+        {
+            uint32_t stream; // STREAM_VIDEO or STREAM_AUDIO
+            uint64_t sequence; // resumed once a newer record is published
+            std::chrono::steady_clock::time_point deadline;
+            std::coroutine_handle<> handle;
+            std::atomic<bool> cancelled{false};
+            std::optional<Reader::Frame> frame;
+            std::optional<Reader::AudioPacket> audioPacket;
+        };
+
+        template <class T>
+        class Awaiter
+        {
+        public:
+            Awaiter(AsyncReader& pReader, uint32_t stream, std::chrono::nanoseconds timeout, std::stop_token pStopToken):
+                reader(pReader),
+                stopToken(std::move(pStopToken))
+            {
+                waiter.stream = stream;
+                waiter.deadline = getDeadline(timeout);
+            }
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> handle)
+            {
+                waiter.handle = handle;
+
+                // cancellation may come from any thread, the loop resumes the coroutine on its own thread
+                if (stopToken.stop_possible())
+                    stopCallback.emplace(stopToken, StopRequest{ &reader, &waiter });
+
+                reader.add(waiter);
+            }
+
+            std::optional<T> await_resume()
+            {
+                stopCallback.reset();
+
+                if constexpr (std::is_same<T, Reader::Frame>::value)
+                    return waiter.frame;
+                else
+                    return waiter.audioPacket;
+            }
+
+        private:
+            struct StopRequest
+            {
+                AsyncReader* reader;
+                Waiter* waiter;
+
+                void operator()() const
+                {
+                    waiter->cancelled.store(true, std::memory_order_release);
+                    reader->reader.wake();
+                }
+            };
+
+            AsyncReader& reader;
+            std::stop_token stopToken;
+            Waiter waiter;
+            std::optional<std::stop_callback<StopRequest>> stopCallback;
+        };
+
+    public:
+        bool open(const std::string& name)
+        {
+            return reader.open(name, 0);
+        }
+
+        const std::string& getError() const { return reader.getError(); }
+        const Reader& getReader() const { return reader; }
+
+        // resumes with the latest frame once a newer one than at the call was published, or with nothing on timeout, cancellation or stop
+        // a consumer that falls behind skips records, the gap shows in the sequences it gets
+        Awaiter<Reader::Frame> nextFrame(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max(),
+                                         std::stop_token stopToken = {})
+        {
+            return Awaiter<Reader::Frame>(*this, STREAM_VIDEO, timeout, std::move(stopToken));
+        }
+
+        Awaiter<Reader::AudioPacket> nextAudioPacket(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max(),
+                                                     std::stop_token stopToken = {})
+        {
+            return Awaiter<Reader::AudioPacket>(*this, STREAM_AUDIO, timeout, std::move(stopToken));
+        }
+
+        // resumes the waiting coroutines on the calling thread until stop is called
+        void run()
+        {
+            std::vector<Waiter*> ready;
+
+            loopThread.store(std::this_thread::get_id(), std::memory_order_release);
+
+            for (;;)
+            {
+                // loaded before the sequences are checked, so that a publish in between cuts the wait short
+                uint32_t counter = reader.getFrameCounter();
+                bool stopping = stopped.load(std::memory_order_acquire);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+                {
+                    std::lock_guard<std::mutex> lock(waiterMutex);
+
+                    for (auto i = waiters.begin(); i != waiters.end();)
+                    {
+                        Waiter* waiter = *i;
+
+                        if (stopping || waiter->cancelled.load(std::memory_order_acquire) || now >= waiter->deadline ||
+                            getSequence(waiter->stream) > waiter->sequence)
+                        {
+                            ready.push_back(waiter);
+                            i = waiters.erase(i);
+                        }
+                        else
+                        {
+                            deadline = std::min(deadline, waiter->deadline);
+                            ++i;
+                        }
+                    }
+                }
+
+                // every waiter woken by the same publish gets the same record, the latest one
+                std::optional<Reader::Frame> frame;
+                std::optional<Reader::AudioPacket> audioPacket;
+                bool frameRead = false;
+                bool audioPacketRead = false;
+
+                for (Waiter* waiter : ready)
+                {
+                    if (stopping || waiter->cancelled.load(std::memory_order_acquire) ||
+                        getSequence(waiter->stream) <= waiter->sequence) continue;
+
+                    if (waiter->stream == STREAM_VIDEO)
+                    {
+                        if (!frameRead)
+                        {
+                            Reader::Frame latest;
+                            if (reader.latestFrame(latest)) frame = latest;
+                            frameRead = true;
+                        }
+
+                        waiter->frame = frame;
+                    }
+                    else
+                    {
+                        if (!audioPacketRead)
+                        {
+                            Reader::AudioPacket latest;
+                            if (reader.latestAudioPacket(latest)) audioPacket = latest;
+                            audioPacketRead = true;
+                        }
+
+                        waiter->audioPacket = audioPacket;
+                    }
+                }
+
+                // the resumed coroutines may wait again, which takes the lock
+                for (Waiter* waiter : ready) waiter->handle.resume();
+
+                // coroutines that waited again after the stop stay queued for the next run
+                if (stopping) break;
+
+                if (!ready.empty())
+                {
+                    ready.clear();
+                    continue;
+                }
+
+                reader.wait(counter, std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now));
+            }
+
+            loopThread.store(std::thread::id(), std::memory_order_release);
+            stopped.store(false, std::memory_order_release);
+        }
+
+        // may be called from any thread, run resumes the waiting coroutines with nothing and returns
+        void stop()
+        {
+            stopped.store(true, std::memory_order_release);
+            reader.wake();
+        }
+
+    private:
+        static std::chrono::steady_clock::time_point getDeadline(std::chrono::nanoseconds timeout)
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            if (timeout >= std::chrono::steady_clock::time_point::max() - now) return std::chrono::steady_clock::time_point::max();
+
+            return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+        }
+
+        uint64_t getSequence(uint32_t stream) const
+        {
+            const Header* header = reader.getHeader();
+
+            return (stream == STREAM_VIDEO) ?
+                header->video.sequence.load(std::memory_order_acquire) :
+                header->audio.sequence.load(std::memory_order_acquire);
+        }
+
+        void add(Waiter& waiter)
+        {
+            waiter.sequence = getSequence(waiter.stream);
+
+            bool wake;
+
+            {
+                std::lock_guard<std::mutex> lock(waiterMutex);
+                waiters.push_back(&waiter);
+
+                // the loop may be sleeping with a later deadline, it picks up the waiters its own coroutines add before it sleeps
+                // decided under the lock, once it is released the loop may resume the coroutine and destroy the waiter
+                wake = loopThread.load(std::memory_order_acquire) != std::this_thread::get_id() &&
+                    (waiter.deadline != std::chrono::steady_clock::time_point::max() ||
+                     waiter.cancelled.load(std::memory_order_acquire));
+            }
+
+            if (wake) reader.wake();
+        }
+
+        Reader reader;
+
+        std::mutex waiterMutex;
+        std::vector<Waiter*> waiters;
+        std::atomic<bool> stopped{false};
+        std::atomic<std::thread::id> loopThread{std::thread::id()};
+    };
+}
@@ -0,0 +1,261 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// layout of the shared memory segment written by bmdmemory
+// the segment is a POSIX shared memory object, or a file of the same name on a hugetlbfs mount if started with --huge_pages 2
+namespace bmdmemory
+{
+    static const uint32_t LAYOUT_MAGIC = 0x4D444D42; // "BMDM" in little endian
+    static const uint32_t LAYOUT_VERSION = 12;
+    static const uint32_t LATENCY_BUCKETS = 256;
+    static const uint32_t MAX_READERS = 16;
+    static const uint32_t LATEST_FRAME_SEQUENCE_BITS = 40;
+    static const uint32_t MAX_VIDEO_SLOTS = 1U << (64 - LATEST_FRAME_SEQUENCE_BITS);
+
+    enum ReaderState: uint32_t
+    {
+        READER_FREE = 0,
+        READER_CLAIMING = 1, // claimed with a compare and swap from READER_FREE, cursor is being initialized
+        READER_ACTIVE = 2,
+        READER_DROPPED = 3 // the writer dropped the reader, it has to resynchronize and become active again
+    };
+
+    enum Stream: uint32_t
+    {
+        STREAM_VIDEO = 0x01,
+        STREAM_AUDIO = 0x02
+    };
+
+    struct StreamHeader
+    {
+        std::atomic<uint64_t> sequence; // sequence of the latest record, 0 if none was published yet
+        std::atomic<uint64_t> offset; // offset of the latest record from the start of the segment
+        std::atomic<uint32_t> queued; // records the writer holds back until the readers catch up
+        std::atomic<uint32_t> backlog; // video frames or audio sample frames the SDK has not delivered yet
+        std::atomic<uint64_t> lost; // records that were never published
+    };
+
+    // the newest complete video frame, readers find it with a single load instead of going through the stream header and the index
+    struct LatestFrame
+    {
+        std::atomic<uint64_t> descriptor; // slot index above the low LATEST_FRAME_SEQUENCE_BITS bits of the sequence, 0 if no frame was published yet
+        uint64_t slotsOffset; // offset of the video record of the first slot, the records do not move while the writer runs
+        uint64_t slotSize; // distance between the video records of two slots
+    };
+
+    enum LatencyMetric: uint32_t
+    {
+        LATENCY_QUEUE = 0, // from the SDK callback until the writer thread picks the record up
+        LATENCY_COPY = 1, // copying the payload to the segment, frames the card wrote directly are not counted
+        LATENCY_PUBLISH = 2, // from the SDK callback until the record is published
+        LATENCY_JITTER = 3, // difference between the arrival interval and the stream time interval of the SDK
+        LATENCY_METRIC_COUNT = 4
+    };
+
+    // log-linear histogram of nanoseconds, 8 buckets per power of two, so values are off by at most 12.5%
+    struct LatencyHistogram
+    {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+    };
+
+    // written by the writer thread only
+    struct Stats
+    {
+        LatencyHistogram video[LATENCY_METRIC_COUNT];
+        LatencyHistogram audio[LATENCY_METRIC_COUNT];
+    };
+
+    // claimed by a reader, sequences are updated by the reader, lags and overruns by the writer
+    struct ReaderCursor
+    {
+        std::atomic<uint32_t> state; // ReaderState
+        uint32_t pid;
+        uint32_t streams; // Stream mask of the streams the reader consumes
+        std::atomic<uint32_t> owner; // incremented by every claim, a reader whose claim it no longer matches lost the cursor
+        std::atomic<uint64_t> heartbeat; // steady clock (CLOCK_MONOTONIC on Linux) in nanoseconds
+        std::atomic<uint64_t> videoSequence; // last consumed video record
+        std::atomic<uint64_t> audioSequence; // last consumed audio record
+        std::atomic<uint64_t> videoLag; // records published but not consumed yet
+        std::atomic<uint64_t> audioLag;
+        std::atomic<uint64_t> videoOverruns; // records overwritten before the reader consumed them
+        std::atomic<uint64_t> audioOverruns;
+    };
+
+    struct Header
+    {
+        std::atomic<uint32_t> magic; // LAYOUT_MAGIC, stored last when the segment is created
+        uint32_t version; // LAYOUT_VERSION, readers must not use a segment of another version
+        uint64_t size; // size of the whole segment
+        uint32_t headerSize;
+        std::atomic<uint32_t> frameCounter; // incremented after every publish, futex word
+        std::atomic<uint32_t> waiterCount; // readers sleeping on the frame counter
+        uint32_t pageSize; // size of the pages backing the segment, huge page size if it lives on hugetlbfs
+        int32_t numaNode; // node the segment is placed on, the one the card is attached to, -1 if unknown
+        std::atomic<uint32_t> writerQueueDepth; // callbacks the writer thread has not handled yet
+        std::atomic<uint32_t> writerQueueHighWater; // the deepest the writer queue has been
+        uint32_t reserved;
+
+        StreamHeader metaData;
+        StreamHeader video;
+        StreamHeader audio;
+        LatestFrame latestFrame;
+
+        ReaderCursor readers[MAX_READERS];
+
+        Stats stats;
+    };
+
+    // every record starts with a generation, which is odd while the record is being written
+    struct MetaDataRecord
+    {
+        std::atomic<uint64_t> generation;
+        uint64_t sequence;
+
+        uint32_t pixelFormat;
+        uint32_t width;
+        uint32_t height;
+        uint32_t frameDuration; // numerator
+        uint32_t timeScale; // denominator
+        uint32_t fieldDominance;
+
+        uint32_t audioSampleRate;
+        uint32_t audioSampleDepth;
+        uint32_t audioChannels;
+
+        uint32_t videoSlotCount;
+        uint32_t videoSlotSize;
+        uint32_t audioIndexCount;
+        uint64_t videoIndexOffset;
+        uint64_t videoSlotsOffset;
+        uint64_t audioIndexOffset;
+        uint64_t audioDataOffset;
+        uint64_t audioDataSize;
+    };
+
+    // stored directly in front of the frame data
+    struct VideoRecord
+    {
+        std::atomic<uint64_t> generation;
+        uint64_t sequence;
+        uint64_t timestamp; // stream time in units of the time scale of the metadata
+        uint32_t duration;
+        uint32_t width;
+        uint32_t height;
+        uint32_t stride;
+        uint32_t dataSize;
+        uint32_t reserved;
+        uint64_t hardwareTimestamp; // hardware reference clock of the card in nanoseconds, 0 if unavailable
+        uint64_t arrivalTime; // CLOCK_MONOTONIC in nanoseconds when the SDK delivered the frame
+        uint64_t arrivalRealTime; // CLOCK_REALTIME in nanoseconds when the SDK delivered the frame
+    };
+
+    enum IndexFlags: uint32_t
+    {
+        INDEX_FORMAT_CHANGED = 0x01 // first record after a format change
+    };
+
+    // entry sequence % slot count of the video index and sequence % audio index count of the audio index
+    // timestamps grow with the sequence, so that readers can binary search the index
+    struct IndexEntry
+    {
+        std::atomic<uint64_t> sequence; // stored last, 0 while the entry is written and after the record was overwritten
+        uint64_t offset; // offset of the record
+        uint64_t timestamp; // stream time of the record
+        uint64_t hardwareTimestamp; // of video frames, 0 in the audio index, audio is delivered with the hardware time of the video frame
+        uint32_t flags; // IndexFlags
+        uint32_t reserved;
+    };
+
+    // stored directly in front of the samples, records are 8 byte aligned
+    struct AudioRecord
+    {
+        std::atomic<uint64_t> generation;
+        uint64_t sequence;
+        uint64_t timestamp; // packet time in sample frames
+        uint32_t sampleFrameCount;
+        uint32_t dataSize;
+        uint64_t hardwareTimestamp; // of the video frame the packet was delivered with
+        uint64_t arrivalTime;
+        uint64_t arrivalRealTime;
+    };
+
+    inline uint64_t getLatestFrameSequence(uint64_t descriptor)
+    {
+        return descriptor & ((1ULL << LATEST_FRAME_SEQUENCE_BITS) - 1);
+    }
+
+    inline uint32_t getLatestFrameSlot(uint64_t descriptor)
+    {
+        return static_cast<uint32_t>(descriptor >> LATEST_FRAME_SEQUENCE_BITS);
+    }
+
+    // offset of the video record the descriptor points to
+    inline uint64_t getLatestFrameOffset(const LatestFrame& latestFrame, uint64_t descriptor)
+    {
+        return latestFrame.slotsOffset + getLatestFrameSlot(descriptor) * latestFrame.slotSize;
+    }
+
+    inline uint32_t getLatencyBucket(uint64_t value)
+    {
+        if (value < 8) return static_cast<uint32_t>(value);
+
+        uint32_t exponent = 63 - static_cast<uint32_t>(__builtin_clzll(value));
+        uint64_t bucket = (exponent - 2) * 8 + ((value >> (exponent - 3)) & 7);
+
+        return bucket < LATENCY_BUCKETS ? static_cast<uint32_t>(bucket) : LATENCY_BUCKETS - 1;
+    }
+
+    // the largest value that falls into the bucket
+    inline uint64_t getLatencyBucketValue(uint32_t bucket)
+    {
+        if (bucket < 8) return bucket;
+
+        uint32_t exponent = bucket / 8 + 2;
+
+        return ((static_cast<uint64_t>(8 + bucket % 8) + 1) << (exponent - 3)) - 1;
+    }
+
+    // percentile between 0 and 1, never larger than the maximum
+    inline uint64_t getLatencyPercentile(const LatencyHistogram& histogram, double percentile)
+    {
+        uint64_t count = histogram.count.load(std::memory_order_relaxed);
+        uint64_t max = histogram.max.load(std::memory_order_relaxed);
+        uint64_t target = static_cast<uint64_t>(percentile * static_cast<double>(count) + 0.5);
+        uint64_t total = 0;
+
+        if (target == 0) target = 1;
+
+        for (uint32_t bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+        {
+            total += histogram.buckets[bucket].load(std::memory_order_relaxed);
+
+            if (total >= target)
+            {
+                uint64_t value = getLatencyBucketValue(bucket);
+                return value < max ? value : max;
+            }
+        }
+
+        return max;
+    }
+
+    static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "64-bit atomics must not carry a lock");
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "32-bit atomics must not carry a lock");
+    static_assert(sizeof(StreamHeader) == 32, "Unexpected stream header size");
+    static_assert(sizeof(LatestFrame) == 24, "Unexpected latest frame size");
+    static_assert(sizeof(ReaderCursor) == 72, "Unexpected reader cursor size");
+    static_assert(sizeof(LatencyHistogram) == 16 + LATENCY_BUCKETS * 8, "Unexpected latency histogram size");
+    static_assert(sizeof(Header) == 168 + MAX_READERS * sizeof(ReaderCursor) + sizeof(Stats), "Unexpected header size");
+    static_assert(sizeof(MetaDataRecord) == 104, "Unexpected metadata record size");
+    static_assert(sizeof(VideoRecord) == 72, "Unexpected video record size");
+    static_assert(sizeof(IndexEntry) == 40, "Unexpected index entry size");
+    static_assert(sizeof(AudioRecord) == 56, "Unexpected audio record size");
+}
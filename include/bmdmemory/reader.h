@@ -0,0 +1,846 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#include "bmdmemory/layout.h"
+
+// reads the segment of a running bmdmemory without copying the records out of it
+// the segment is mapped read only, only the header is mapped writable for the reader cursor and the waiter count
+// a reader is not thread safe, every thread should use its own
+namespace bmdmemory
+{
+    class Reader
+    {
+    public:
+        struct Format
+        {
+            uint64_t sequence = 0; // changes every time the writer publishes a new format
+            uint32_t pixelFormat = 0;
+            uint32_t width = 0;
+            uint32_t height = 0;
+            uint32_t frameDuration = 0;
+            uint32_t timeScale = 0;
+            uint32_t fieldDominance = 0;
+            uint32_t audioSampleRate = 0;
+            uint32_t audioSampleDepth = 0;
+            uint32_t audioChannels = 0;
+        };
+
+        // view of a video frame in the segment, the data is only valid as long as isValid returns true
+        class Frame
+        {
+        public:
+            const uint8_t* getData() const { return reinterpret_cast<const uint8_t*>(record) + sizeof(VideoRecord); }
+            uint32_t getDataSize() const { return dataSize; }
+            uint32_t getWidth() const { return width; }
+            uint32_t getHeight() const { return height; }
+            uint32_t getStride() const { return stride; }
+            uint64_t getSequence() const { return sequence; }
+            uint64_t getTimestamp() const { return timestamp; }
+            uint32_t getDuration() const { return duration; }
+            uint64_t getHardwareTimestamp() const { return hardwareTimestamp; }
+            uint64_t getArrivalTime() const { return arrivalTime; }
+            uint64_t getArrivalRealTime() const { return arrivalRealTime; }
+            uint32_t getFlags() const { return flags; } // IndexFlags, 0 once the record dropped out of the index
+            uint64_t getGeneration() const { return generation; }
+
+            // false once the writer has started to reuse the slot, whatever was read from the data before has to be discarded
+            bool isValid() const
+            {
+                if (!record) return false;
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return record->generation.load(std::memory_order_relaxed) == generation;
+            }
+
+        private:
+            friend class Reader;
+
+            const VideoRecord* record = nullptr;
+            uint64_t generation = 0;
+            uint64_t sequence = 0;
+            uint64_t timestamp = 0;
+            uint32_t duration = 0;
+            uint32_t width = 0;
+            uint32_t height = 0;
+            uint32_t stride = 0;
+            uint32_t dataSize = 0;
+            uint64_t hardwareTimestamp = 0;
+            uint64_t arrivalTime = 0;
+            uint64_t arrivalRealTime = 0;
+            uint32_t flags = 0;
+        };
+
+        // view of an audio packet in the segment, the samples are interleaved
+        class AudioPacket
+        {
+        public:
+            const uint8_t* getData() const { return reinterpret_cast<const uint8_t*>(record) + sizeof(AudioRecord); }
+            uint32_t getDataSize() const { return dataSize; }
+            uint32_t getSampleFrameCount() const { return sampleFrameCount; }
+            uint64_t getSequence() const { return sequence; }
+            uint64_t getTimestamp() const { return timestamp; }
+            uint64_t getHardwareTimestamp() const { return hardwareTimestamp; }
+            uint64_t getArrivalTime() const { return arrivalTime; }
+            uint64_t getArrivalRealTime() const { return arrivalRealTime; }
+            uint32_t getFlags() const { return flags; } // IndexFlags, 0 once the record dropped out of the index
+            uint64_t getGeneration() const { return generation; }
+
+            bool isValid() const
+            {
+                if (!record) return false;
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return record->generation.load(std::memory_order_relaxed) == generation;
+            }
+
+        private:
+            friend class Reader;
+
+            const AudioRecord* record = nullptr;
+            uint64_t generation = 0;
+            uint64_t sequence = 0;
+            uint64_t timestamp = 0;
+            uint32_t sampleFrameCount = 0;
+            uint32_t dataSize = 0;
+            uint64_t hardwareTimestamp = 0;
+            uint64_t arrivalTime = 0;
+            uint64_t arrivalRealTime = 0;
+            uint32_t flags = 0;
+        };
+
+        Reader() {}
+        ~Reader() { close(); }
+
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        // claims a reader cursor for the given Stream mask, so that the writer accounts for the reader, none if it is 0
+        // a reader without write access to the segment claims none and polls
+        bool open(const std::string& name, uint32_t pStreams = STREAM_VIDEO | STREAM_AUDIO)
+        {
+            close();
+
+            bool writable = true;
+            int fd = openSharedMemory(name, O_RDWR);
+
+            if (fd == -1)
+            {
+                // without write access the reader can not claim a cursor and has to poll
+                writable = false;
+                fd = openSharedMemory(name, O_RDONLY);
+            }
+
+            if (fd == -1)
+            {
+                error = "Failed to open shared memory " + name;
+                return false;
+            }
+
+            struct stat fileStat;
+
+            if (fstat(fd, &fileStat) == -1 ||
+                static_cast<size_t>(fileStat.st_size) < sizeof(Header))
+            {
+                error = "Shared memory " + name + " is too small";
+                ::close(fd);
+                return false;
+            }
+
+            size = static_cast<size_t>(fileStat.st_size);
+            void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+            if (mapping == MAP_FAILED)
+            {
+                error = "Failed to map shared memory " + name;
+                ::close(fd);
+                return false;
+            }
+
+            sharedMemory = static_cast<const uint8_t*>(mapping);
+            header = reinterpret_cast<const Header*>(sharedMemory);
+
+            if (header->magic.load(std::memory_order_acquire) != LAYOUT_MAGIC ||
+                header->version != LAYOUT_VERSION ||
+                header->size > size)
+            {
+                error = "Shared memory " + name + " has an unsupported layout";
+                ::close(fd);
+                close();
+                return false;
+            }
+
+            if (writable && header->pageSize)
+            {
+                writableHeaderSize = (sizeof(Header) + header->pageSize - 1) / header->pageSize * header->pageSize;
+                mapping = mmap(nullptr, writableHeaderSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+                if (mapping != MAP_FAILED) writableHeader = static_cast<Header*>(mapping);
+            }
+
+            ::close(fd);
+
+            if (!readLayout())
+            {
+                error = "Shared memory " + name + " has no metadata yet";
+                close();
+                return false;
+            }
+
+            // starts with the latest records
+            uint64_t latestVideo = header->video.sequence.load(std::memory_order_acquire);
+            uint64_t latestAudio = header->audio.sequence.load(std::memory_order_acquire);
+            videoSequence = latestVideo ? latestVideo - 1 : 0;
+            audioSequence = latestAudio ? latestAudio - 1 : 0;
+
+            // the cursors live in the header, which only a writable mapping can update
+            streams = writableHeader ? pStreams : 0;
+
+            if (streams && !claimCursor())
+            {
+                error = "All " + std::to_string(MAX_READERS) + " reader cursors of shared memory " + name + " are in use";
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        void close()
+        {
+            // a cursor the writer freed may have been claimed by another reader since
+            uint32_t state = cursor ? cursor->state.load(std::memory_order_acquire) : READER_FREE;
+
+            if (ownsCursor(state)) cursor->state.compare_exchange_strong(state, READER_FREE);
+            cursor = nullptr;
+
+            if (writableHeader) munmap(writableHeader, writableHeaderSize);
+            writableHeader = nullptr;
+
+            if (sharedMemory) munmap(const_cast<uint8_t*>(sharedMemory), size);
+            sharedMemory = nullptr;
+            header = nullptr;
+            size = 0;
+        }
+
+        bool isOpen() const { return sharedMemory != nullptr; }
+        const std::string& getError() const { return error; }
+        const Header* getHeader() const { return header; }
+
+        // copies the current format, returns false if the writer was updating it
+        bool getFormat(Format& format) const
+        {
+            uint64_t sequence = header->metaData.sequence.load(std::memory_order_acquire);
+            uint64_t offset = header->metaData.offset.load(std::memory_order_relaxed);
+
+            if (!sequence || offset + sizeof(MetaDataRecord) > size) return false;
+
+            const MetaDataRecord* record = reinterpret_cast<const MetaDataRecord*>(sharedMemory + offset);
+            uint64_t generation = record->generation.load(std::memory_order_acquire);
+
+            if (generation & 1) return false;
+
+            format.sequence = record->sequence;
+            format.pixelFormat = record->pixelFormat;
+            format.width = record->width;
+            format.height = record->height;
+            format.frameDuration = record->frameDuration;
+            format.timeScale = record->timeScale;
+            format.fieldDominance = record->fieldDominance;
+            format.audioSampleRate = record->audioSampleRate;
+            format.audioSampleDepth = record->audioSampleDepth;
+            format.audioChannels = record->audioChannels;
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            return record->generation.load(std::memory_order_relaxed) == generation;
+        }
+
+        // returns false if no frame was published after the last one this reader returned
+        bool nextFrame(Frame& frame)
+        {
+            updateCursor();
+
+            uint64_t latest = header->video.sequence.load(std::memory_order_acquire);
+
+            // the frames older than the video slots have been overwritten for sure
+            if (latest > videoSequence + videoSlotCount) videoSequence = latest - videoSlotCount;
+
+            while (videoSequence < latest)
+            {
+                if (getFrame(videoSequence + 1, frame))
+                {
+                    consumeFrame(frame.sequence);
+                    return true;
+                }
+
+                // overwritten before the reader got to it
+                ++videoSequence;
+            }
+
+            return false;
+        }
+
+        bool nextFrame(Frame& frame, std::chrono::nanoseconds timeout)
+        {
+            std::chrono::steady_clock::time_point deadline = getDeadline(timeout);
+
+            while (!nextFrame(frame))
+            {
+                if (!waitForRecord(header->video, videoSequence, deadline)) return false;
+            }
+
+            return true;
+        }
+
+        // returns the newest frame, even if this reader has returned it before
+        bool latestFrame(Frame& frame)
+        {
+            updateCursor();
+
+            for (uint32_t attempt = 0; attempt < 4; ++attempt)
+            {
+                // slot and sequence of the newest frame in one word, the offset of the slot does not change
+                uint64_t descriptor = header->latestFrame.descriptor.load(std::memory_order_acquire);
+
+                if (!descriptor) return false;
+
+                if (getFrameRecord(getLatestFrameOffset(header->latestFrame, descriptor), getLatestFrameSequence(descriptor), frame))
+                {
+                    consumeFrame(frame.sequence);
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // waits for a frame newer than the last one this reader returned
+        bool latestFrame(Frame& frame, std::chrono::nanoseconds timeout)
+        {
+            std::chrono::steady_clock::time_point deadline = getDeadline(timeout);
+
+            while (header->video.sequence.load(std::memory_order_acquire) <= videoSequence)
+            {
+                if (!waitForRecord(header->video, videoSequence, deadline)) return false;
+            }
+
+            return latestFrame(frame);
+        }
+
+        bool nextAudioPacket(AudioPacket& packet)
+        {
+            updateCursor();
+
+            uint64_t latest = header->audio.sequence.load(std::memory_order_acquire);
+
+            if (audioSequence >= latest) return false;
+
+            // the next record follows the last one, or starts the next lap of the ring
+            if (audioOffset &&
+                (getAudioPacket(audioOffset + audioRecordSize, audioSequence + 1, packet) ||
+                 getAudioPacket(audioDataOffset, audioSequence + 1, packet)))
+            {
+                consumeAudioPacket(packet);
+                return true;
+            }
+
+            // the reader has just started or the records it has not read have been overwritten
+            return latestAudioPacket(packet);
+        }
+
+        bool nextAudioPacket(AudioPacket& packet, std::chrono::nanoseconds timeout)
+        {
+            std::chrono::steady_clock::time_point deadline = getDeadline(timeout);
+
+            while (!nextAudioPacket(packet))
+            {
+                if (!waitForRecord(header->audio, audioSequence, deadline)) return false;
+            }
+
+            return true;
+        }
+
+        bool latestAudioPacket(AudioPacket& packet)
+        {
+            updateCursor();
+
+            for (uint32_t attempt = 0; attempt < 4; ++attempt)
+            {
+                // the offset may already belong to a newer record, which the sequence check catches
+                uint64_t latest = header->audio.sequence.load(std::memory_order_acquire);
+                uint64_t offset = header->audio.offset.load(std::memory_order_relaxed);
+
+                if (!latest) return false;
+
+                if (getAudioPacket(offset, latest, packet))
+                {
+                    consumeAudioPacket(packet);
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        bool latestAudioPacket(AudioPacket& packet, std::chrono::nanoseconds timeout)
+        {
+            std::chrono::steady_clock::time_point deadline = getDeadline(timeout);
+
+            while (header->audio.sequence.load(std::memory_order_acquire) <= audioSequence)
+            {
+                if (!waitForRecord(header->audio, audioSequence, deadline)) return false;
+            }
+
+            return latestAudioPacket(packet);
+        }
+
+        enum TimestampType
+        {
+            STREAM_TIME, // time scale units for video, sample frames for audio
+            HARDWARE_TIME // hardware reference clock of the card in nanoseconds
+        };
+
+        // the frame with the latest timestamp not after the given one, found with a binary search of the index
+        // the following nextFrame calls continue after it, hardware time is only searched if the card provides it
+        bool findFrame(uint64_t timestamp, Frame& frame, TimestampType type = STREAM_TIME)
+        {
+            updateCursor();
+
+            const IndexEntry* index = reinterpret_cast<const IndexEntry*>(sharedMemory + videoIndexOffset);
+            uint64_t sequence = searchIndex(index, videoSlotCount, header->video.sequence.load(std::memory_order_acquire), timestamp, type);
+
+            if (!sequence || !getFrame(sequence, frame)) return false;
+
+            // without a hardware clock every timestamp is 0 and the search ends at the latest frame
+            if (type == HARDWARE_TIME && !frame.hardwareTimestamp) return false;
+
+            consumeFrame(frame.sequence);
+
+            return true;
+        }
+
+        // the packet with the latest stream time not after the given one, the following nextAudioPacket calls continue after it
+        // packets carry the hardware time of the video frame they arrived with, which is not ordered enough to search
+        bool findAudioPacket(uint64_t timestamp, AudioPacket& packet)
+        {
+            updateCursor();
+
+            const IndexEntry* index = reinterpret_cast<const IndexEntry*>(sharedMemory + audioIndexOffset);
+            uint64_t sequence = searchIndex(index, audioIndexCount, header->audio.sequence.load(std::memory_order_acquire), timestamp, STREAM_TIME);
+            IndexValue value;
+
+            if (!sequence ||
+                !readIndexEntry(index, audioIndexCount, sequence, value) ||
+                !getAudioPacket(value.offset, sequence, packet)) return false;
+
+            consumeAudioPacket(packet);
+
+            return true;
+        }
+
+        // the writer frees the cursor of a reader that has not called any of the reading methods for 5 seconds
+        void heartbeat()
+        {
+            if (ownsCursor()) cursor->heartbeat.store(getTime(), std::memory_order_relaxed);
+        }
+
+        // incremented by the writer after every publish
+        uint32_t getFrameCounter() const { return header->frameCounter.load(std::memory_order_seq_cst); }
+
+        // sleeps until the frame counter differs from the given one, the timeout passes or wake is called
+        // may return early, wakes up at least once per second to keep the cursor alive
+        void wait(uint32_t counter, std::chrono::nanoseconds timeout)
+        {
+            if (timeout > std::chrono::seconds(1)) timeout = std::chrono::seconds(1);
+
+            updateCursor();
+
+#if defined(__linux__)
+            if (writableHeader)
+            {
+                struct timespec futexTimeout;
+                futexTimeout.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+                futexTimeout.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+
+                writableHeader->waiterCount.fetch_add(1, std::memory_order_seq_cst);
+
+                if (writableHeader->frameCounter.load(std::memory_order_seq_cst) == counter)
+                {
+                    syscall(SYS_futex, &writableHeader->frameCounter, FUTEX_WAIT, counter, &futexTimeout, nullptr, 0);
+                }
+
+                writableHeader->waiterCount.fetch_sub(1, std::memory_order_seq_cst);
+                return;
+            }
+#endif
+
+            // nothing to sleep on, poll
+            if (header->frameCounter.load(std::memory_order_seq_cst) != counter) return;
+            if (timeout > std::chrono::milliseconds(1)) timeout = std::chrono::milliseconds(1);
+            std::this_thread::sleep_for(timeout);
+        }
+
+        // wakes the threads sleeping in wait, those of other readers of the segment too, they check their conditions again
+        void wake()
+        {
+#if defined(__linux__)
+            if (writableHeader) syscall(SYS_futex, &writableHeader->frameCounter, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+        }
+
+    private:
+        // opens the segment, on a hugetlbfs mount if it is not a POSIX shared memory object
+        static int openSharedMemory(const std::string& name, int flags)
+        {
+            int fd = shm_open(name.c_str(), flags, 0);
+
+            std::ifstream mounts("/proc/mounts");
+            std::string device, path, type, line;
+
+            while (fd == -1 && std::getline(mounts, line))
+            {
+                std::istringstream stream(line);
+
+                if (stream >> device >> path >> type && type == "hugetlbfs")
+                {
+                    fd = ::open((path + "/" + name.substr(name.find_first_not_of('/'))).c_str(), flags);
+                }
+            }
+
+            return fd;
+        }
+
+        static uint64_t getTime()
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        static std::chrono::steady_clock::time_point getDeadline(std::chrono::nanoseconds timeout)
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+            if (timeout >= std::chrono::steady_clock::time_point::max() - now) return std::chrono::steady_clock::time_point::max();
+
+            return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+        }
+
+        struct IndexValue
+        {
+            uint64_t offset = 0;
+            uint64_t timestamp = 0;
+            uint64_t hardwareTimestamp = 0;
+            uint32_t flags = 0;
+        };
+
+        // false if the entry holds another sequence or is being written
+        static bool readIndexEntry(const IndexEntry* index, uint32_t count, uint64_t sequence, IndexValue& value)
+        {
+            if (!count || !sequence) return false;
+
+            const IndexEntry& entry = index[sequence % count];
+
+            if (entry.sequence.load(std::memory_order_acquire) != sequence) return false;
+
+            value.offset = entry.offset;
+            value.timestamp = entry.timestamp;
+            value.hardwareTimestamp = entry.hardwareTimestamp;
+            value.flags = entry.flags;
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return entry.sequence.load(std::memory_order_relaxed) == sequence;
+        }
+
+        // the latest indexed sequence with a timestamp not after the given one, 0 if there is none
+        static uint64_t searchIndex(const IndexEntry* index, uint32_t count, uint64_t latest, uint64_t timestamp, TimestampType type)
+        {
+            uint64_t low = (latest > count) ? latest - count + 1 : 1;
+            uint64_t high = latest;
+            uint64_t result = 0;
+
+            while (count && low <= high)
+            {
+                uint64_t middle = low + (high - low) / 2;
+                IndexValue value;
+
+                // only the oldest entries are overwritten, so the rest of the search is newer
+                if (!readIndexEntry(index, count, middle, value))
+                {
+                    low = middle + 1;
+                    continue;
+                }
+
+                if (((type == HARDWARE_TIME) ? value.hardwareTimestamp : value.timestamp) <= timestamp)
+                {
+                    result = middle;
+                    low = middle + 1;
+                }
+                else
+                    high = middle - 1;
+            }
+
+            return result;
+        }
+
+        // the offsets of the video slots and the audio ring do not change while the writer runs
+        bool readLayout()
+        {
+            uint64_t sequence = header->metaData.sequence.load(std::memory_order_acquire);
+            uint64_t offset = header->metaData.offset.load(std::memory_order_relaxed);
+
+            if (!sequence || offset + sizeof(MetaDataRecord) > size) return false;
+
+            const MetaDataRecord* record = reinterpret_cast<const MetaDataRecord*>(sharedMemory + offset);
+
+            if (record->generation.load(std::memory_order_acquire) & 1) return false;
+
+            videoSlotCount = record->videoSlotCount;
+            videoIndexOffset = record->videoIndexOffset;
+            videoSlotsOffset = record->videoSlotsOffset;
+            audioIndexOffset = record->audioIndexOffset;
+            audioIndexCount = record->audioIndexCount;
+            audioDataOffset = record->audioDataOffset;
+            audioDataSize = record->audioDataSize;
+
+            return videoSlotCount &&
+                videoIndexOffset + videoSlotCount * sizeof(IndexEntry) <= size &&
+                audioIndexOffset + audioIndexCount * sizeof(IndexEntry) <= size &&
+                audioDataOffset + audioDataSize <= size;
+        }
+
+        bool claimCursor()
+        {
+            if (!writableHeader) return false;
+
+            for (ReaderCursor& readerCursor : writableHeader->readers)
+            {
+                uint32_t state = READER_FREE;
+
+                if (!readerCursor.state.compare_exchange_strong(state, READER_CLAIMING)) continue;
+
+                // not the pid, a process may open several readers
+                owner = readerCursor.owner.fetch_add(1, std::memory_order_relaxed) + 1;
+                readerCursor.pid = static_cast<uint32_t>(getpid());
+                readerCursor.streams = streams;
+                readerCursor.heartbeat.store(getTime(), std::memory_order_relaxed);
+                readerCursor.videoSequence.store(videoSequence, std::memory_order_relaxed);
+                readerCursor.audioSequence.store(audioSequence, std::memory_order_relaxed);
+                readerCursor.videoLag.store(0, std::memory_order_relaxed);
+                readerCursor.audioLag.store(0, std::memory_order_relaxed);
+                readerCursor.videoOverruns.store(0, std::memory_order_relaxed);
+                readerCursor.audioOverruns.store(0, std::memory_order_relaxed);
+                readerCursor.state.store(READER_ACTIVE, std::memory_order_release);
+
+                cursor = &readerCursor;
+                return true;
+            }
+
+            return false;
+        }
+
+        void updateCursor()
+        {
+            if (!cursor) return;
+
+            uint32_t state = cursor->state.load(std::memory_order_acquire);
+
+            if (!ownsCursor(state))
+            {
+                // the writer timed the reader out, the cursor may belong to another reader by now
+                cursor = nullptr;
+                claimCursor();
+            }
+            else if (state == READER_DROPPED)
+            {
+                // data the reader had not consumed was overwritten, continue with the latest records
+                uint64_t latestVideo = header->video.sequence.load(std::memory_order_acquire);
+                uint64_t latestAudio = header->audio.sequence.load(std::memory_order_acquire);
+
+                if (latestVideo > videoSequence + 1) videoSequence = latestVideo - 1;
+                if (latestAudio > audioSequence + 1)
+                {
+                    audioSequence = latestAudio - 1;
+                    audioOffset = 0;
+                }
+
+                cursor->videoSequence.store(videoSequence, std::memory_order_release);
+                cursor->audioSequence.store(audioSequence, std::memory_order_release);
+                cursor->heartbeat.store(getTime(), std::memory_order_relaxed);
+                cursor->state.compare_exchange_strong(state, READER_ACTIVE);
+            }
+            else
+                heartbeat();
+        }
+
+        // the record is consumed once the reader asks for the next one, until then the backpressure policy keeps it intact
+        void consumeFrame(uint64_t sequence)
+        {
+            videoSequence = sequence;
+            if (ownsCursor()) cursor->videoSequence.store(sequence - 1, std::memory_order_release);
+        }
+
+        void consumeAudioPacket(const AudioPacket& packet)
+        {
+            audioSequence = packet.sequence;
+            audioOffset = static_cast<uint64_t>(reinterpret_cast<const uint8_t*>(packet.record) - sharedMemory);
+            audioRecordSize = (sizeof(AudioRecord) + packet.dataSize + 7) / 8 * 8;
+            if (ownsCursor()) cursor->audioSequence.store(packet.sequence - 1, std::memory_order_release);
+        }
+
+        bool ownsCursor() const
+        {
+            return cursor && ownsCursor(cursor->state.load(std::memory_order_acquire));
+        }
+
+        // the claim is checked before every write, the owner is stored before a new claim becomes active
+        bool ownsCursor(uint32_t state) const
+        {
+            return cursor &&
+                (state == READER_ACTIVE || state == READER_DROPPED) &&
+                cursor->owner.load(std::memory_order_relaxed) == owner;
+        }
+
+        bool getFrame(uint64_t sequence, Frame& frame) const
+        {
+            const IndexEntry* index = reinterpret_cast<const IndexEntry*>(sharedMemory + videoIndexOffset);
+            IndexValue value;
+
+            if (!readIndexEntry(index, videoSlotCount, sequence, value)) return false;
+
+            return getFrameRecord(value.offset, sequence, frame);
+        }
+
+        // the sequence is compared in the bits the latest frame descriptor holds
+        bool getFrameRecord(uint64_t offset, uint64_t sequence, Frame& frame) const
+        {
+            if (offset < videoSlotsOffset || offset + sizeof(VideoRecord) > size) return false;
+
+            const VideoRecord* record = reinterpret_cast<const VideoRecord*>(sharedMemory + offset);
+            uint64_t generation = record->generation.load(std::memory_order_acquire);
+
+            if (generation & 1) return false;
+
+            Frame result;
+            result.record = record;
+            result.generation = generation;
+            result.sequence = record->sequence;
+            result.timestamp = record->timestamp;
+            result.duration = record->duration;
+            result.width = record->width;
+            result.height = record->height;
+            result.stride = record->stride;
+            result.dataSize = record->dataSize;
+            result.hardwareTimestamp = record->hardwareTimestamp;
+            result.arrivalTime = record->arrivalTime;
+            result.arrivalRealTime = record->arrivalRealTime;
+
+            // the slot may have been reused for a newer frame while the record was read
+            if (!result.isValid() ||
+                getLatestFrameSequence(result.sequence) != getLatestFrameSequence(sequence) ||
+                offset + sizeof(VideoRecord) + result.dataSize > size) return false;
+
+            IndexValue value;
+            const IndexEntry* index = reinterpret_cast<const IndexEntry*>(sharedMemory + videoIndexOffset);
+            if (readIndexEntry(index, videoSlotCount, result.sequence, value)) result.flags = value.flags;
+
+            frame = result;
+
+            return true;
+        }
+
+        bool getAudioPacket(uint64_t offset, uint64_t sequence, AudioPacket& packet) const
+        {
+            if (offset < audioDataOffset || offset + sizeof(AudioRecord) > audioDataOffset + audioDataSize) return false;
+
+            const AudioRecord* record = reinterpret_cast<const AudioRecord*>(sharedMemory + offset);
+            uint64_t generation = record->generation.load(std::memory_order_acquire);
+
+            if (generation & 1) return false;
+
+            AudioPacket result;
+            result.record = record;
+            result.generation = generation;
+            result.sequence = record->sequence;
+            result.timestamp = record->timestamp;
+            result.sampleFrameCount = record->sampleFrameCount;
+            result.dataSize = record->dataSize;
+            result.hardwareTimestamp = record->hardwareTimestamp;
+            result.arrivalTime = record->arrivalTime;
+            result.arrivalRealTime = record->arrivalRealTime;
+
+            if (!result.isValid() ||
+                result.sequence != sequence ||
+                offset + sizeof(AudioRecord) + result.dataSize > audioDataOffset + audioDataSize) return false;
+
+            IndexValue value;
+            const IndexEntry* index = reinterpret_cast<const IndexEntry*>(sharedMemory + audioIndexOffset);
+            if (readIndexEntry(index, audioIndexCount, result.sequence, value)) result.flags = value.flags;
+
+            packet = result;
+
+            return true;
+        }
+
+        // returns false on timeout
+        bool waitForRecord(const StreamHeader& stream, uint64_t sequence, std::chrono::steady_clock::time_point deadline)
+        {
+            for (;;)
+            {
+                // the counter is loaded first, so that a publish after the check changes it and the futex does not sleep
+                uint32_t counter = getFrameCounter();
+
+                if (stream.sequence.load(std::memory_order_acquire) > sequence) return true;
+
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+                if (now >= deadline) return false;
+
+                wait(counter, std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now));
+            }
+        }
+
+        std::string error;
+
+        const uint8_t* sharedMemory = nullptr;
+        size_t size = 0;
+        const Header* header = nullptr;
+        Header* writableHeader = nullptr;
+        size_t writableHeaderSize = 0;
+
+        uint32_t streams = 0;
+        ReaderCursor* cursor = nullptr;
+        uint32_t owner = 0; // claim the cursor was taken with
+
+        uint32_t videoSlotCount = 0;
+        uint64_t videoIndexOffset = 0;
+        uint64_t videoSlotsOffset = 0;
+        uint64_t audioIndexOffset = 0;
+        uint32_t audioIndexCount = 0;
+        uint64_t audioDataOffset = 0;
+        uint64_t audioDataSize = 0;
+
+        uint64_t videoSequence = 0; // last frame returned
+        uint64_t audioSequence = 0; // last audio packet returned
+        uint64_t audioOffset = 0; // offset of the last audio packet returned, 0 if none
+        uint64_t audioRecordSize = 0;
+    };
+}
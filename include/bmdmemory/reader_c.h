@@ -0,0 +1,92 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <stdint.h>
+
+// C interface of the reader, built as libbmdmemory_reader.so, for ctypes, cffi and other foreign function interfaces
+// the frame data points into the shared memory, so a NumPy array can be created over it without a copy:
+//   numpy.ctypeslib.as_array(frame.data, shape=(frame.height, frame.stride))
+// check bmdmemory_reader_frame_valid after reading the data, the writer may have reused the slot in the meantime
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct bmdmemory_reader bmdmemory_reader;
+
+typedef struct
+{
+    uint64_t sequence;
+    uint32_t pixel_format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t frame_duration;
+    uint32_t time_scale;
+    uint32_t field_dominance;
+    uint32_t audio_sample_rate;
+    uint32_t audio_sample_depth;
+    uint32_t audio_channels;
+} bmdmemory_format;
+
+typedef struct
+{
+    const uint8_t* data;
+    uint32_t data_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint64_t sequence;
+    uint64_t timestamp;
+    uint32_t duration;
+    uint32_t flags; // 1 for the first frame after a format change
+    uint64_t hardware_timestamp;
+    uint64_t arrival_time;
+    uint64_t arrival_real_time;
+    uint64_t generation;
+} bmdmemory_frame;
+
+typedef struct
+{
+    const uint8_t* data;
+    uint32_t data_size;
+    uint32_t sample_frame_count;
+    uint64_t sequence;
+    uint64_t timestamp;
+    uint64_t hardware_timestamp;
+    uint64_t arrival_time;
+    uint64_t arrival_real_time;
+    uint64_t generation;
+    uint32_t flags;
+    uint32_t reserved;
+} bmdmemory_audio_packet;
+
+// streams is a mask of 1 for video and 2 for audio, a reader cursor is claimed for them unless it is 0
+bmdmemory_reader* bmdmemory_reader_open(const char* name, uint32_t streams);
+void bmdmemory_reader_close(bmdmemory_reader* reader);
+
+// error of the last failed open, the reader is returned even if it failed to open and has to be closed
+const char* bmdmemory_reader_get_error(const bmdmemory_reader* reader);
+int bmdmemory_reader_is_open(const bmdmemory_reader* reader);
+
+int bmdmemory_reader_get_format(const bmdmemory_reader* reader, bmdmemory_format* format);
+
+// the timeout is in nanoseconds, 0 returns immediately and a negative one waits forever, returns 1 on success and 0 otherwise
+int bmdmemory_reader_next_frame(bmdmemory_reader* reader, bmdmemory_frame* frame, int64_t timeout);
+int bmdmemory_reader_latest_frame(bmdmemory_reader* reader, bmdmemory_frame* frame, int64_t timeout);
+int bmdmemory_reader_frame_valid(const bmdmemory_frame* frame);
+
+// the frame with the latest timestamp not after the given one, stream time if hardware is 0 and hardware reference time otherwise
+// audio packets are found by stream time only
+int bmdmemory_reader_find_frame(bmdmemory_reader* reader, bmdmemory_frame* frame, uint64_t timestamp, int hardware);
+
+int bmdmemory_reader_next_audio_packet(bmdmemory_reader* reader, bmdmemory_audio_packet* packet, int64_t timeout);
+int bmdmemory_reader_latest_audio_packet(bmdmemory_reader* reader, bmdmemory_audio_packet* packet, int64_t timeout);
+int bmdmemory_reader_audio_packet_valid(const bmdmemory_audio_packet* packet);
+int bmdmemory_reader_find_audio_packet(bmdmemory_reader* reader, bmdmemory_audio_packet* packet, uint64_t timestamp);
+
+#ifdef __cplusplus
+}
+#endif
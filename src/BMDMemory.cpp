@@ -2,26 +2,41 @@
 //  BMD memory
 //
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <functional>
+#include <limits>
+#include <sstream>
 #include <mutex>
+#include <vector>
 #include <iostream>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/fcntl.h>
 #include <sys/types.h>
 #include <limits.h>
+#if defined(__linux__)
+#include <fstream>
+#include <linux/futex.h>
+#include <linux/magic.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#endif
+#include <cstdlib>
 #include <cstring>
 #include "BMDMemory.h"
 #include "Log.h"
 
+// forwards the callbacks of the SDK directly to the target, without locks or type-erased calls on the frame path
+template <class T>
 class InputCallback:public IDeckLinkInputCallback
 {
 public:
-    InputCallback(const std::function<bool(BMDVideoInputFormatChangedEvents,
-                                           IDeckLinkDisplayMode*,
-                                           BMDDetectedVideoInputFormatFlags)>& pVideoInputFormatChangeCallback,
-                  const std::function<bool(IDeckLinkVideoInputFrame*, IDeckLinkAudioInputPacket*)>& pVideoInputFrameArriveCallback):
-        videoInputFormatChangeCallback(pVideoInputFormatChangeCallback),
-        videoInputFrameArriveCallback(pVideoInputFrameArriveCallback)
+    explicit InputCallback(T* pTarget):
+        target(pTarget)
     {
     }
 
@@ -29,32 +44,26 @@ public:
 
     virtual ULONG STDMETHODCALLTYPE AddRef()
     {
-        std::lock_guard<std::mutex> lock(dataMutex);
-
-        refCount++;
-        
-        return refCount;
+        return refCount.fetch_add(1, std::memory_order_relaxed) + 1;
     }
 
     virtual ULONG STDMETHODCALLTYPE Release()
     {
-        std::lock_guard<std::mutex> lock(dataMutex);
-        refCount--;
+        ULONG result = refCount.fetch_sub(1, std::memory_order_acq_rel) - 1;
 
-        if (refCount == 0)
+        if (result == 0)
         {
             delete this;
-            return 0;
         }
 
-        return refCount;
+        return result;
     }
 
     virtual HRESULT STDMETHODCALLTYPE VideoInputFormatChanged(BMDVideoInputFormatChangedEvents changeEvents,
                                                               IDeckLinkDisplayMode* newDisplayMode,
                                                               BMDDetectedVideoInputFormatFlags formatFlags)
     {
-        if (!videoInputFormatChangeCallback(changeEvents, newDisplayMode, formatFlags))
+        if (!target->videoInputFormatChanged(changeEvents, newDisplayMode, formatFlags))
         {
             return S_FALSE;
         }
@@ -65,7 +74,7 @@ public:
     virtual HRESULT STDMETHODCALLTYPE VideoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame,
                                                              IDeckLinkAudioInputPacket* audioFrame)
     {
-        if (!videoInputFrameArriveCallback(videoFrame, audioFrame))
+        if (!target->videoInputFrameArrived(videoFrame, audioFrame))
         {
             return S_FALSE;
         }
@@ -74,52 +83,548 @@ public:
     }
 
 private:
-    ULONG refCount;
+    std::atomic<ULONG> refCount{1};
+    T* target;
+};
+
+// makes the generation odd, so that readers of the old record contents discard what they have read
+static uint64_t beginWrite(std::atomic<uint64_t>& generation)
+{
+    uint64_t value = generation.load(std::memory_order_relaxed);
+    value += (value & 1) ? 2 : 1;
+    generation.store(value, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    return value;
+}
+
+// makes the generation even again once the record is complete
+static void endWrite(std::atomic<uint64_t>& generation)
+{
+    generation.store(generation.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+static void publish(bmdmemory::StreamHeader& stream, uint64_t sequence, uint64_t offset)
+{
+    // readers load the sequence with acquire semantics and then the offset
+    stream.offset.store(offset, std::memory_order_relaxed);
+    stream.sequence.store(sequence, std::memory_order_release);
+}
+
+// the sequence is cleared first, so that readers never mix the fields of two records
+static void writeIndexEntry(bmdmemory::IndexEntry& entry, uint64_t sequence, uint64_t offset,
+                            uint64_t timestamp, uint64_t hardwareTimestamp, uint32_t flags)
+{
+    entry.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    entry.offset = offset;
+    entry.timestamp = timestamp;
+    entry.hardwareTimestamp = hardwareTimestamp;
+    entry.flags = flags;
+    entry.reserved = 0;
+
+    entry.sequence.store(sequence, std::memory_order_release);
+}
+
+// only the writer thread records, so the counters do not need atomic read-modify-writes
+static void recordLatency(bmdmemory::LatencyHistogram& histogram, uint64_t value)
+{
+    std::atomic<uint64_t>& bucket = histogram.buckets[bmdmemory::getLatencyBucket(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (value > histogram.max.load(std::memory_order_relaxed)) histogram.max.store(value, std::memory_order_relaxed);
+
+    histogram.count.store(histogram.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// hands out video slots from the shared memory, so that the card writes frames directly to the memory readers map
+class FrameAllocator:public IDeckLinkMemoryAllocator
+{
+public:
+    FrameAllocator(bmdmemory::IndexEntry* pIndex,
+                   uint8_t* pData,
+                   uint32_t pSlotCount,
+                   uint32_t pSlotSize,
+                   uint32_t pSlotHeaderSize,
+                   uint32_t pOverflowBufferCount,
+                   std::atomic<uint64_t>* pLostFrames,
+                   const std::function<bool(uint64_t)>& pFrameConsumedCallback,
+                   const std::function<void(uint64_t)>& pFrameOverwriteCallback):
+        index(pIndex),
+        data(pData),
+        slotSize(pSlotSize),
+        slotHeaderSize(pSlotHeaderSize),
+        slots(pSlotCount),
+        overflowBufferCount(pOverflowBufferCount),
+        lostFrames(pLostFrames),
+        frameConsumedCallback(pFrameConsumedCallback),
+        frameOverwriteCallback(pFrameOverwriteCallback)
+    {
+    }
+
+    virtual ~FrameAllocator()
+    {
+        for (void* buffer : overflowBuffers) free(buffer);
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, LPVOID*) { return E_NOINTERFACE; }
+
+    virtual ULONG STDMETHODCALLTYPE AddRef()
+    {
+        return refCount.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    virtual ULONG STDMETHODCALLTYPE Release()
+    {
+        ULONG result = refCount.fetch_sub(1, std::memory_order_acq_rel) - 1;
+
+        if (result == 0)
+        {
+            delete this;
+        }
+
+        return result;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE AllocateBuffer(uint32_t bufferSize, void** allocatedBuffer)
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+
+        // frames of a larger mode than the slots were sized for can not be captured, neither in a slot nor from the heap
+        if (bufferSize > getBufferSize())
+        {
+            if (!bufferTooLarge)
+            {
+                Log(Log::Level::ERR) << "Video buffer of " << bufferSize << " bytes does not fit in the " << getBufferSize() << " byte slots, restart to capture the new mode";
+                bufferTooLarge = true;
+            }
+
+            lostFrames->fetch_add(1, std::memory_order_relaxed);
+            return E_OUTOFMEMORY;
+        }
+
+        uint8_t* buffer = acquireSlot(bufferSize, Slot::State::SDK);
+
+        if (!buffer && overflowBuffers.size() < overflowBufferCount)
+        {
+            // every slot holds unread frames, let the SDK deliver the frame in heap memory so that the writer can queue it
+            void* overflowBuffer;
+
+            if (posix_memalign(&overflowBuffer, slotHeaderSize, bufferSize) == 0)
+            {
+                overflowBuffers.push_back(overflowBuffer);
+                *allocatedBuffer = overflowBuffer;
+                return S_OK;
+            }
+        }
+
+        if (!buffer)
+        {
+            Log(Log::Level::WARN) << "No free slot for a " << bufferSize << " byte video buffer";
+            lostFrames->fetch_add(1, std::memory_order_relaxed);
+            return E_OUTOFMEMORY;
+        }
+
+        *allocatedBuffer = buffer;
+
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE ReleaseBuffer(void* buffer)
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+
+        Slot* slot = findSlot(buffer);
+
+        if (!slot)
+        {
+            auto i = std::find(overflowBuffers.begin(), overflowBuffers.end(), buffer);
+
+            if (i == overflowBuffers.end())
+            {
+                return E_INVALIDARG;
+            }
+
+            free(buffer);
+            overflowBuffers.erase(i);
+
+            return S_OK;
+        }
+
+        slot->state = Slot::State::FREE;
+
+        return S_OK;
+    }
+
+    virtual HRESULT STDMETHODCALLTYPE Commit() { return S_OK; }
+    virtual HRESULT STDMETHODCALLTYPE Decommit() { return S_OK; }
+
+    // the largest frame a slot holds, fixed when the segment is created
+    uint32_t getBufferSize() const { return slotSize - slotHeaderSize; }
+
+    bool contains(const void* buffer)
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+
+        return findSlot(buffer) != nullptr;
+    }
+
+    // returns a slot for a frame the SDK has delivered in its own memory
+    uint8_t* acquireBuffer(uint32_t bufferSize)
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+
+        return acquireSlot(bufferSize, Slot::State::WRITER);
+    }
+
+    void releaseBuffer(const void* buffer)
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+
+        if (Slot* slot = findSlot(buffer))
+        {
+            if (slot->state == Slot::State::WRITER) slot->state = Slot::State::FREE;
+        }
+    }
+
+    void publishBuffer(const void* buffer, uint64_t sequence)
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+
+        if (Slot* slot = findSlot(buffer))
+        {
+            slot->sequence = sequence;
+        }
+    }
+
+private:
+    struct Slot
+    {
+        enum class State
+        {
+            FREE, // may still hold a published frame
+            SDK, // handed out to the SDK, must not be touched
+            WRITER // being filled by the copy path
+        };
+
+        State state = State::FREE;
+        uint64_t sequence = 0; // sequence of the last frame published in this slot
+    };
+
+    uint8_t* slotBuffer(uint32_t slotIndex) const
+    {
+        // the slot header page holds the record header, directly in front of the page aligned frame data
+        return data + static_cast<size_t>(slotIndex) * slotSize + slotHeaderSize;
+    }
+
+    Slot* findSlot(const void* buffer)
+    {
+        const uint8_t* pointer = static_cast<const uint8_t*>(buffer);
+
+        if (pointer < data + slotHeaderSize ||
+            pointer >= data + static_cast<size_t>(slots.size()) * slotSize) return nullptr;
+
+        uint32_t slotIndex = static_cast<uint32_t>((pointer - data) / slotSize);
+
+        if (slotBuffer(slotIndex) != pointer) return nullptr;
+
+        return &slots[slotIndex];
+    }
+
+    uint8_t* acquireSlot(uint32_t bufferSize, Slot::State state)
+    {
+        if (bufferSize > slotSize - slotHeaderSize)
+        {
+            return nullptr;
+        }
+
+        // reuse the slot holding the oldest frame, never the ones the SDK still holds
+        Slot* oldestSlot = nullptr;
+        uint32_t oldestIndex = 0;
+
+        for (uint32_t slotIndex = 0; slotIndex < slots.size(); ++slotIndex)
+        {
+            if (slots[slotIndex].state == Slot::State::FREE &&
+                (!oldestSlot || slots[slotIndex].sequence < oldestSlot->sequence))
+            {
+                oldestSlot = &slots[slotIndex];
+                oldestIndex = slotIndex;
+            }
+        }
+
+        if (!oldestSlot)
+        {
+            return nullptr;
+        }
+
+        // the other free slots hold newer frames, so none of them can be reused either
+        if (oldestSlot->sequence && !frameConsumedCallback(oldestSlot->sequence))
+        {
+            return nullptr;
+        }
+
+        if (oldestSlot->sequence)
+        {
+            // drop the overwritten frame from the index, unless a newer frame already took its entry
+            uint64_t sequence = oldestSlot->sequence;
+            index[sequence % slots.size()].sequence.compare_exchange_strong(sequence, 0);
+
+            frameOverwriteCallback(oldestSlot->sequence);
+
+            // the slot may be released again without a frame, its old frame must not be counted twice
+            oldestSlot->sequence = 0;
+        }
+
+        // readers still copying the old frame will see it torn
+        bmdmemory::VideoRecord* record = reinterpret_cast<bmdmemory::VideoRecord*>(slotBuffer(oldestIndex) - sizeof(bmdmemory::VideoRecord));
+        beginWrite(record->generation);
+
+        oldestSlot->state = state;
+
+        return slotBuffer(oldestIndex);
+    }
+
+    std::atomic<ULONG> refCount{1};
     std::mutex dataMutex;
+    bool bufferTooLarge = false; // logged only once
+
+    bmdmemory::IndexEntry* index;
+    uint8_t* data;
+    const uint32_t slotSize;
+    const uint32_t slotHeaderSize;
+    std::vector<Slot> slots;
 
-    std::function<bool(BMDVideoInputFormatChangedEvents, IDeckLinkDisplayMode*, BMDDetectedVideoInputFormatFlags)> videoInputFormatChangeCallback;
-    std::function<bool(IDeckLinkVideoInputFrame*, IDeckLinkAudioInputPacket*)> videoInputFrameArriveCallback;
+    const uint32_t overflowBufferCount;
+    std::vector<void*> overflowBuffers; // heap buffers handed to the SDK while every slot holds unread frames
+    std::atomic<uint64_t>* lostFrames;
+
+    std::function<bool(uint64_t)> frameConsumedCallback;
+    std::function<void(uint64_t)> frameOverwriteCallback;
 };
 
+static uint32_t getRowBytes(BMDPixelFormat pixelFormat, uint32_t width)
+{
+    switch (pixelFormat)
+    {
+        case bmdFormat8BitYUV: return width * 2;
+        case bmdFormat10BitYUV: return ((width + 47) / 48) * 128;
+        case bmdFormat8BitARGB: return width * 4;
+        case bmdFormat8BitBGRA: return width * 4;
+        case bmdFormat10BitRGB: return ((width + 63) / 64) * 256;
+        case bmdFormat12BitRGB: return (width * 36) / 8;
+        case bmdFormat12BitRGBLE: return (width * 36) / 8;
+        case bmdFormat10BitRGBXLE: return ((width + 63) / 64) * 256;
+        case bmdFormat10BitRGBX: return ((width + 63) / 64) * 256;
+        default: return width * 4;
+    }
+}
+
+#if defined(__linux__)
+static std::string readSysFile(const std::string& path)
+{
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+
+    return value;
+}
+#endif
+
+// parses a list like "0-3,8-11", the format of sysfs and --cpu_affinity
+static std::vector<uint32_t> parseCpuList(const std::string& list)
+{
+    std::vector<uint32_t> cpus;
+    std::istringstream stream(list);
+    std::string range;
+
+    while (std::getline(stream, range, ','))
+    {
+        if (range.empty()) continue;
+
+        size_t dash = range.find('-');
+        uint32_t first = static_cast<uint32_t>(strtoul(range.c_str(), nullptr, 10));
+        uint32_t last = (dash == std::string::npos) ? first : static_cast<uint32_t>(strtoul(range.c_str() + dash + 1, nullptr, 10));
+
+        for (uint32_t cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+// pins the thread to the CPUs, does nothing if there are none
+static bool pinThread(pthread_t thread, const std::vector<uint32_t>& cpus)
+{
+    if (cpus.empty()) return true;
+
+#if defined(__linux__)
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+
+    for (uint32_t cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpuSet);
+    }
+
+    if (pthread_setaffinity_np(thread, sizeof(cpuSet), &cpuSet) != 0)
+    {
+        Log(Log::Level::WARN) << "Failed to set the CPU affinity of a thread";
+        return false;
+    }
+
+    return true;
+#else
+    (void)thread;
+    return false;
+#endif
+}
+
+void BMDMemory::benchmarkCallback(uint32_t iterations)
+{
+    // the SDK references the callback around every call
+    struct Target
+    {
+        bool videoInputFormatChanged(BMDVideoInputFormatChangedEvents, IDeckLinkDisplayMode*, BMDDetectedVideoInputFormatFlags) { return true; }
+        bool videoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame, IDeckLinkAudioInputPacket*) { return videoFrame == nullptr; }
+    } target;
+
+    // the callback as it was before, with a mutex around the reference count and std::function dispatch
+    struct LockingCallback
+    {
+        std::mutex dataMutex;
+        ULONG refCount = 1;
+        std::function<bool(IDeckLinkVideoInputFrame*, IDeckLinkAudioInputPacket*)> videoInputFrameArriveCallback;
+
+        ULONG AddRef() { std::lock_guard<std::mutex> lock(dataMutex); return ++refCount; }
+        ULONG Release() { std::lock_guard<std::mutex> lock(dataMutex); return --refCount; }
+        HRESULT VideoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame, IDeckLinkAudioInputPacket* audioFrame)
+        {
+            return videoInputFrameArriveCallback(videoFrame, audioFrame) ? S_OK : S_FALSE;
+        }
+    } lockingCallback;
+
+    lockingCallback.videoInputFrameArriveCallback = std::bind(&Target::videoInputFrameArrived, &target, std::placeholders::_1, std::placeholders::_2);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        lockingCallback.AddRef();
+        lockingCallback.VideoInputFrameArrived(nullptr, nullptr);
+        lockingCallback.Release();
+    }
+
+    double lockingTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+    // called through the interface, like the SDK does
+    IDeckLinkInputCallback* callback = new InputCallback<Target>(&target);
+
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < iterations; ++i)
+    {
+        callback->AddRef();
+        callback->VideoInputFrameArrived(nullptr, nullptr);
+        callback->Release();
+    }
+
+    double directTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+    callback->Release();
+
+    Log(Log::Level::INFO) << "Callback with mutex and std::function: " << lockingTime << " ns, lock-free direct callback: " << directTime << " ns";
+}
+
 BMDMemory::BMDMemory(const std::string& pName,
                      int32_t pInstance,
                      int32_t pVideoMode,
                      int32_t pVideoConnection,
                      int32_t pVideoFormat,
-                     int32_t pAudioConnection):
+                     int32_t pAudioConnection,
+                     uint32_t pVideoSlotCount,
+                     uint32_t pHistoryDuration,
+                     uint64_t pAudioDataSize,
+                     uint64_t pMemorySize,
+                     const std::string& pEventSocketPath,
+                     ReaderPolicy pReaderPolicy,
+                     uint32_t pOverflowQueueSize,
+                     HugePages pHugePages,
+                     const std::string& pHugePagesPath,
+                     int32_t pNumaNode,
+                     const std::string& pCopyKernel,
+                     uint32_t pCopyThreadCount,
+                     uint32_t pWriterQueueSize,
+                     int32_t pRtPriority,
+                     const std::string& pCpuAffinity):
     name(pName),
     instance(pInstance),
     videoMode(pVideoMode),
     videoConnection(pVideoConnection),
     videoFormat(pVideoFormat),
     audioConnection(pAudioConnection),
-    headerSize(sizeof(currentMetaDataOffset) + sizeof(currentVideoDataOffset) + sizeof(currentAudioDataOffset)),
+    videoSlotCount(pVideoSlotCount),
+    historyDuration(pHistoryDuration),
+    requestedAudioDataSize(pAudioDataSize),
+    requestedMemorySize(pMemorySize),
+    eventSocketPath(pEventSocketPath),
+    readerPolicy(pReaderPolicy),
+    overflowQueueSize(pOverflowQueueSize),
+    pageSize(static_cast<uint32_t>(sysconf(_SC_PAGESIZE))),
+    numaNode(pNumaNode),
+    copyKernel(pCopyKernel),
+    copyThreadCount(pCopyThreadCount),
+    writerQueue(pWriterQueueSize ? pWriterQueueSize : 1),
+    rtPriority(pRtPriority),
+    cpuAffinity(parseCpuList(pCpuAffinity)),
+    hugePages(pHugePages),
+    hugePagesPath(pHugePagesPath),
+    headerSize(sizeof(bmdmemory::Header)),
     metaDataOffset(headerSize),
-    metaDataSize(100), // 100 bytes
-    videoDataOffset(metaDataOffset + metaDataSize),
-    videoDataSize(80 * 1024 * 1024), // 80 MiB
-    audioDataOffset(videoDataOffset + videoDataSize),
-    audioDataSize(sharedMemorySize - audioDataOffset)
+    metaDataSize(256) // 256 bytes
 {
 }
 
 BMDMemory::~BMDMemory()
 {
+    if (deckLinkInput)
+    {
+        // the card must stop writing to the shared memory before it is unmapped
+        deckLinkInput->StopStreams();
+        deckLinkInput->DisableVideoInput();
+        deckLinkInput->DisableAudioInput();
+        deckLinkInput->SetCallback(nullptr);
+        deckLinkInput->SetVideoInputFrameMemoryAllocator(nullptr);
+    }
+
+    if (writerThread.joinable())
+    {
+        writerRunning.store(false);
+        wakeWriter();
+        writerThread.join();
+    }
+
+    WriterItem item;
+    while (writerQueue.pop(item))
+    {
+        if (item.videoFrame) item.videoFrame->Release();
+        if (item.audioFrame) item.audioFrame->Release();
+    }
+
+    if (pendingDisplayMode) pendingDisplayMode->Release();
+
+    for (const auto& videoFrame : videoOverflowQueue) videoFrame.first->Release();
+    for (const auto& audioFrame : audioOverflowQueue) audioFrame.first->Release();
+
     if (inputCallback) inputCallback->Release();
+    if (frameAllocator) frameAllocator->Release();
 
     if (deckLinkConfiguration) deckLinkConfiguration->Release();
     if (displayMode) displayMode->Release();
     if (displayModeIterator) displayModeIterator->Release();
     if (deckLinkInput) deckLinkInput->Release();
-    if (deckLink)
-    {
-        deckLinkInput->StopStreams();
-        deckLinkInput->DisableVideoInput();
-        deckLinkInput->DisableAudioInput();
-        deckLink->Release();
-    }
+    if (deckLink) deckLink->Release();
 
-    if (sharedMemoryFd)
+    if (sharedMemoryFd != -1)
     {
         if (close(sharedMemoryFd) == -1)
         {
@@ -127,7 +632,7 @@ BMDMemory::~BMDMemory()
         }
     }
 
-    if (sharedMemory == MAP_FAILED)
+    if (sharedMemory != MAP_FAILED)
     {
         if (munmap(sharedMemory, sharedMemorySize) == -1)
         {
@@ -135,7 +640,14 @@ BMDMemory::~BMDMemory()
         }
     }
 
-    if (shm_unlink(name.c_str()) == -1)
+    if (!sharedMemoryPath.empty())
+    {
+        if (unlink(sharedMemoryPath.c_str()) == -1)
+        {
+            Log(Log::Level::ERR) << "Failed to delete shared memory file " << sharedMemoryPath;
+        }
+    }
+    else if (shm_unlink(name.c_str()) == -1)
     {
         Log(Log::Level::ERR) << "Failed to delete shared memory";
     }
@@ -143,30 +655,42 @@ BMDMemory::~BMDMemory()
 
 bool BMDMemory::run()
 {
-    shm_unlink(name.c_str());
-
-    if ((sharedMemoryFd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR , S_IRUSR | S_IWUSR)) == -1)
+#if defined(__linux__)
+    if (rtPriority > 0 &&
+        (rtPriority < sched_get_priority_min(SCHED_FIFO) || rtPriority > sched_get_priority_max(SCHED_FIFO)))
     {
-        Log(Log::Level::ERR) << "Failed to create shared memory";
+        Log(Log::Level::ERR) << "Realtime priority must be between " << sched_get_priority_min(SCHED_FIFO) << " and " << sched_get_priority_max(SCHED_FIFO);
         return false;
     }
+#endif
 
-    if (ftruncate(sharedMemoryFd, sharedMemorySize) == -1)
+    // threads the SDK creates inherit the affinity of this one
+    setupNuma();
+
+    FrameCopy::Kernel kernel = FrameCopy::getKernel(copyKernel);
+
+    if (!kernel.function)
     {
-        Log(Log::Level::ERR) << "Failed to resize shared memory";
+        Log(Log::Level::ERR) << "Frame copy kernel " << copyKernel << " is not supported by this CPU";
         return false;
     }
 
-    sharedMemory = mmap(nullptr, sharedMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, sharedMemoryFd, 0);
+    copyFrame = kernel.function;
 
-    if (sharedMemory == MAP_FAILED)
+    Log(Log::Level::INFO) << "Frame copy kernel: " << kernel.name;
+
+    // created after the NUMA setup, so that the copy threads inherit its affinity
+    if (copyThreadCount > 1)
     {
-        Log(Log::Level::ERR) << "Failed to map shared memory";
-        return false;
-    }
+        copyPool.reset(new CopyPool(copyThreadCount, copyFrame));
 
-    // fille header with zeros
-    memset(sharedMemory, 0, headerSize);
+        Log(Log::Level::INFO) << "Frames taller than " << parallelCopyHeight << " rows are copied by " << copyPool->getThreadCount() << " threads";
+
+        for (std::thread::native_handle_type thread : copyPool->getNativeHandles())
+        {
+            setupThread(thread, "Copy");
+        }
+    }
 
     IDeckLinkIterator* deckLinkIterator = CreateDeckLinkIteratorInstance();
 
@@ -272,11 +796,6 @@ bool BMDMemory::run()
         return false;
     }
 
-    inputCallback = new InputCallback(std::bind(&BMDMemory::videoInputFormatChanged, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3),
-                                      std::bind(&BMDMemory::videoInputFrameArrived, this, std::placeholders::_1, std::placeholders::_2));
-
-    deckLinkInput->SetCallback(inputCallback);
-
     result = deckLinkInput->GetDisplayModeIterator(&displayModeIterator);
     if (result != S_OK)
     {
@@ -372,20 +891,58 @@ bool BMDMemory::run()
         case 4: pixelFormat = bmdFormat8BitBGRA; break;
     }
 
-    result = deckLinkInput->EnableVideoInput(selectedDisplayMode, pixelFormat, 0);
-    if (result != S_OK)
+    if (!createSharedMemory())
     {
-        Log(Log::Level::ERR) << "Failed to enable video input";
         return false;
     }
 
-    result = deckLinkInput->EnableAudioInput(audioSampleRate,
-                                             audioSampleDepth,
-                                             audioChannels);
+    if (!eventSocketPath.empty())
+    {
+        eventNotifier.reset(new EventNotifier(eventSocketPath));
 
-    Log(Log::Level::INFO) << "audioSampleRate: " << audioSampleRate << ", audioSampleDepth: " << audioSampleDepth << ", audioChannels: " << audioChannels;
+        if (!eventNotifier->start())
+        {
+            return false;
+        }
+    }
 
-    if (result != S_OK)
+    inputCallback = new InputCallback<BMDMemory>(this);
+
+    deckLinkInput->SetCallback(inputCallback);
+
+    frameAllocator = new FrameAllocator(videoIndex,
+                                        reinterpret_cast<uint8_t*>(sharedMemory) + videoSlotsOffset,
+                                        videoSlotCount,
+                                        videoSlotSize,
+                                        pageSize,
+                                        (readerPolicy == ReaderPolicy::BACKPRESSURE) ? overflowQueueSize : 0,
+                                        &header->video.lost,
+                                        [this](uint64_t sequence) {
+                                            return readerPolicy != ReaderPolicy::BACKPRESSURE ||
+                                                sequence <= getConsumedSequence(bmdmemory::STREAM_VIDEO);
+                                        },
+                                        std::bind(&BMDMemory::countOverruns, this, bmdmemory::STREAM_VIDEO, std::placeholders::_1));
+
+    result = deckLinkInput->SetVideoInputFrameMemoryAllocator(frameAllocator);
+    if (result != S_OK)
+    {
+        Log(Log::Level::WARN) << "Failed to set video input frame memory allocator, frames will be copied - result = " << result;
+    }
+
+    result = deckLinkInput->EnableVideoInput(selectedDisplayMode, pixelFormat, 0);
+    if (result != S_OK)
+    {
+        Log(Log::Level::ERR) << "Failed to enable video input";
+        return false;
+    }
+
+    result = deckLinkInput->EnableAudioInput(audioSampleRate,
+                                             audioSampleDepth,
+                                             audioChannels);
+
+    Log(Log::Level::INFO) << "audioSampleRate: " << audioSampleRate << ", audioSampleDepth: " << audioSampleDepth << ", audioChannels: " << audioChannels;
+
+    if (result != S_OK)
     {
         Log(Log::Level::ERR) << "Failed to enable audio input";
         return false;
@@ -393,6 +950,10 @@ bool BMDMemory::run()
 
     writeMetaData();
 
+    writerRunning.store(true);
+    writerThread = std::thread(&BMDMemory::runWriter, this);
+    setupThread(writerThread.native_handle(), "Writer");
+
     result = deckLinkInput->StartStreams();
     if (result != S_OK)
     {
@@ -405,235 +966,1190 @@ bool BMDMemory::run()
     return true;
 }
 
-void BMDMemory::writeMetaData()
+bool BMDMemory::calculateLayout()
 {
-    uint32_t outPixelFormat = 0;
+    // every slot holds a whole frame of the negotiated mode, the header page in front keeps frame data page aligned
+    uint64_t frameSize = static_cast<uint64_t>(getRowBytes(pixelFormat, static_cast<uint32_t>(width))) * static_cast<uint64_t>(height);
+    uint64_t slotSize = pageSize + (frameSize + pageSize - 1) / pageSize * pageSize;
 
-    switch (pixelFormat)
+    // audio the SDK delivers along with one video frame
+    uint64_t sampleFramesPerFrame = (static_cast<uint64_t>(audioSampleRate) * static_cast<uint64_t>(frameDuration) + static_cast<uint64_t>(timeScale) - 1) / static_cast<uint64_t>(timeScale);
+    uint64_t audioRecordSize = (sizeof(bmdmemory::AudioRecord) + sampleFramesPerFrame * audioChannels * (audioSampleDepth / 8) + 7) / 8 * 8;
+
+    uint64_t videoOffset = (metaDataOffset + metaDataSize + pageSize - 1) / pageSize * pageSize;
+
+    uint64_t slotCount = videoSlotCount;
+
+    if (slotCount == 0)
+    {
+        if (historyDuration)
+        {
+            slotCount = (static_cast<uint64_t>(historyDuration) * static_cast<uint64_t>(timeScale) + static_cast<uint64_t>(frameDuration) * 1000 - 1) / (static_cast<uint64_t>(frameDuration) * 1000);
+        }
+        else if (requestedMemorySize)
+        {
+            // fit as many frames as possible, each frame of history takes a slot, an index entry and its audio with its index entry
+            uint64_t frameCost = slotSize + sizeof(bmdmemory::IndexEntry) + (requestedAudioDataSize ? 0 : audioRecordSize + sizeof(bmdmemory::IndexEntry));
+            uint64_t fixedSize = videoOffset + 2 * pageSize + requestedAudioDataSize +
+                (requestedAudioDataSize ? (requestedAudioDataSize / audioRecordSize + 1) * sizeof(bmdmemory::IndexEntry) : 2 * (audioRecordSize + sizeof(bmdmemory::IndexEntry)));
+
+            slotCount = (requestedMemorySize > fixedSize) ? (requestedMemorySize - fixedSize) / frameCost : 0;
+        }
+        else
+        {
+            slotCount = defaultVideoSlotCount;
+        }
+    }
+
+    if (slotCount < 2)
     {
-        case bmdFormat8BitYUV: outPixelFormat = 0; break;
-        case bmdFormat10BitYUV: outPixelFormat = 1; break;
-        case bmdFormat8BitARGB: outPixelFormat = 2; break;
-        case bmdFormat10BitRGB: outPixelFormat = 3; break;
-        case bmdFormat12BitRGB: outPixelFormat = 4; break;
-        case bmdFormat12BitRGBLE: outPixelFormat = 5; break;
-        case bmdFormat10BitRGBXLE: outPixelFormat = 6; break;
-        case bmdFormat10BitRGBX: outPixelFormat = 7; break;
+        Log(Log::Level::ERR) << "At least two video slots are needed";
+        return false;
     }
 
-    uint32_t outWidth = static_cast<uint32_t>(width);
-    uint32_t outHeight = static_cast<uint32_t>(height);
+    if (slotCount > bmdmemory::MAX_VIDEO_SLOTS)
+    {
+        Log(Log::Level::ERR) << "Too many video slots: " << slotCount;
+        return false;
+    }
 
-    uint32_t outFrameDuration = static_cast<uint32_t>(frameDuration);
-    uint32_t outTimeScale = static_cast<uint32_t>(timeScale);
+    uint64_t indexSize = (slotCount * sizeof(bmdmemory::IndexEntry) + pageSize - 1) / pageSize * pageSize;
+    uint64_t audioIndexStart = videoOffset + indexSize + slotSize * slotCount;
 
-    uint32_t outFieldDominance = 0;
+    uint64_t audioSize = requestedAudioDataSize;
+    uint64_t audioEntryCount = 0;
 
-    switch (fieldDominance)
+    if (!audioSize)
     {
-        case bmdUnknownFieldDominance: outFieldDominance = 0; break;
-        case bmdLowerFieldFirst: outFieldDominance = 1; break;
-        case bmdUpperFieldFirst: outFieldDominance = 2; break;
-        case bmdProgressiveFrame: outFieldDominance = 3; break;
-        case bmdProgressiveSegmentedFrame: outFieldDominance = 4; break;
-    }
-
-    uint32_t outAudioSampleRate = audioSampleRate;
-    uint32_t outAudioSampleDepth = audioSampleDepth;
-    uint32_t outAudioChannels = audioChannels;
-
-    if (sizeof(outPixelFormat) +
-        sizeof(outWidth) +
-        sizeof(outHeight) +
-        sizeof(outFrameDuration) +
-        sizeof(outTimeScale) +
-        sizeof(outFieldDominance) +
-        sizeof(outAudioSampleRate) +
-        sizeof(outAudioSampleDepth) +
-        sizeof(outAudioChannels) +
-        currentMetaDataOffset > metaDataSize ||
-        currentMetaDataOffset < metaDataOffset)
+        if (requestedMemorySize)
+        {
+            // audio and its index take whatever the video region left, a page is kept for rounding the index up
+            uint64_t memorySize = requestedMemorySize / segmentPageSize * segmentPageSize;
+            uint64_t remainingSize = (memorySize > audioIndexStart + pageSize) ? memorySize - audioIndexStart - pageSize : 0;
+
+            if (remainingSize < 2 * (audioRecordSize + sizeof(bmdmemory::IndexEntry)))
+            {
+                Log(Log::Level::ERR) << "History of " << slotCount << " frames does not fit in the requested " << requestedMemorySize << " bytes with two audio packets";
+                return false;
+            }
+
+            audioEntryCount = remainingSize / (audioRecordSize + sizeof(bmdmemory::IndexEntry));
+            audioSize = remainingSize + pageSize - (audioEntryCount * sizeof(bmdmemory::IndexEntry) + pageSize - 1) / pageSize * pageSize;
+        }
+        else
+        {
+            // the same history as the video, with room for two more packets in case the SDK delivers them late
+            audioSize = (slotCount + 2) * audioRecordSize;
+        }
+    }
+
+    audioSize = audioSize / 8 * 8;
+
+    // an entry for every packet the audio region holds, packets shorter than a frame drop out of the index before they are overwritten
+    if (!audioEntryCount) audioEntryCount = audioSize / audioRecordSize + 1;
+
+    if (audioEntryCount > UINT32_MAX)
     {
-        currentMetaDataOffset = metaDataOffset;
+        Log(Log::Level::ERR) << "Too many audio index entries: " << audioEntryCount;
+        return false;
     }
 
-    uint32_t offset = currentMetaDataOffset;
+    uint64_t audioIndexSize = (audioEntryCount * sizeof(bmdmemory::IndexEntry) + pageSize - 1) / pageSize * pageSize;
+    uint64_t audioOffset = audioIndexStart + audioIndexSize;
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outPixelFormat, sizeof(outPixelFormat));
-    offset += sizeof(outPixelFormat);
+    if (requestedAudioDataSize && audioSize < 2 * audioRecordSize)
+    {
+        Log(Log::Level::ERR) << "Audio size " << requestedAudioDataSize << " is too small, at least " << 2 * audioRecordSize << " bytes are needed for two packets of one frame";
+        return false;
+    }
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outWidth, sizeof(outWidth));
-    offset += sizeof(outWidth);
+    if (audioSize < 2 * audioRecordSize)
+    {
+        Log(Log::Level::ERR) << "Audio region of " << audioSize << " bytes can not hold two " << audioRecordSize << " byte packets";
+        return false;
+    }
+
+    // hugetlbfs files can only be sized in whole huge pages
+    uint64_t memorySize = (audioOffset + audioSize + segmentPageSize - 1) / segmentPageSize * segmentPageSize;
+
+    if (requestedMemorySize && memorySize > requestedMemorySize)
+    {
+        Log(Log::Level::ERR) << "Shared memory size " << memorySize << " exceeds the requested " << requestedMemorySize << " bytes";
+        return false;
+    }
+
+    if (memorySize > std::numeric_limits<size_t>::max() ||
+        memorySize > static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
+    {
+        Log(Log::Level::ERR) << "Shared memory size " << memorySize << " can not be mapped, use a shorter history";
+        return false;
+    }
+
+    if (slotSize > UINT32_MAX)
+    {
+        Log(Log::Level::ERR) << "Video slot size " << slotSize << " exceeds 4 GiB";
+        return false;
+    }
+
+    videoSlotCount = static_cast<uint32_t>(slotCount);
+    videoSlotSize = static_cast<uint32_t>(slotSize);
+    videoDataOffset = videoOffset;
+    videoIndexOffset = videoDataOffset;
+    videoSlotsOffset = videoOffset + indexSize;
+    videoDataSize = audioIndexStart - videoOffset;
+    audioIndexOffset = audioIndexStart;
+    audioIndexCount = static_cast<uint32_t>(audioEntryCount);
+    audioDataOffset = audioOffset;
+    audioDataSize = audioSize;
+    sharedMemorySize = memorySize;
+
+    Log(Log::Level::INFO) << "Video slots: " << videoSlotCount << ", slot size: " << videoSlotSize <<
+        ", history: " << static_cast<uint64_t>(videoSlotCount) * static_cast<uint64_t>(frameDuration) * 1000 / static_cast<uint64_t>(timeScale) << " ms" <<
+        ", audio size: " << audioDataSize << ", audio index entries: " << audioIndexCount << ", shared memory size: " << sharedMemorySize;
+
+    return true;
+}
+
+void BMDMemory::setupThread(pthread_t thread, const char* threadName)
+{
+    pinThread(thread, cpuAffinity);
+
+#if defined(__linux__)
+    if (rtPriority > 0)
+    {
+        sched_param param;
+        param.sched_priority = rtPriority;
+
+        int error = pthread_setschedparam(thread, SCHED_FIFO, &param);
+
+        if (error == EPERM)
+        {
+            Log(Log::Level::WARN) << threadName << " thread can not use SCHED_FIFO without CAP_SYS_NICE or an RLIMIT_RTPRIO of " << rtPriority << ", it keeps the default policy";
+        }
+        else if (error != 0)
+        {
+            Log(Log::Level::WARN) << "Failed to set the SCHED_FIFO priority " << rtPriority << " for the " << threadName << " thread - error: " << strerror(error);
+        }
+    }
+
+    // the policy the thread ended up with
+    int policy;
+    sched_param param;
+    cpu_set_t cpuSet;
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outHeight, sizeof(outHeight));
-    offset += sizeof(outHeight);
+    if (pthread_getschedparam(thread, &policy, &param) == 0 &&
+        pthread_getaffinity_np(thread, sizeof(cpuSet), &cpuSet) == 0)
+    {
+        Log(Log::Level::INFO) << threadName << " thread policy: " << (policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER") <<
+            ", priority: " << param.sched_priority << ", CPUs: " << CPU_COUNT(&cpuSet);
+    }
+#else
+    if (rtPriority > 0)
+    {
+        Log(Log::Level::WARN) << "Realtime priority is only supported on Linux";
+    }
+#endif
+}
+
+void BMDMemory::setupNuma()
+{
+#if defined(__linux__)
+    if (numaNode < 0)
+    {
+        // the driver registers a device for every card in the order the SDK iterates them
+        for (const char* device : { "io", "dv" })
+        {
+            std::string value = readSysFile("/sys/class/blackmagic/" + std::string(device) + std::to_string(instance) + "/device/numa_node");
+
+            if (!value.empty())
+            {
+                numaNode = atoi(value.c_str());
+                break;
+            }
+        }
+    }
+
+    if (numaNode < 0)
+    {
+        Log(Log::Level::INFO) << "NUMA node of the card is unknown, memory and threads are not placed";
+        numaNode = -1;
+        return;
+    }
+
+    numaCpus = parseCpuList(readSysFile("/sys/devices/system/node/node" + std::to_string(numaNode) + "/cpulist"));
+
+    if (numaCpus.empty())
+    {
+        Log(Log::Level::WARN) << "NUMA node " << numaNode << " has no CPUs, threads are not pinned";
+    }
+    else if (pinThread(pthread_self(), numaCpus))
+    {
+        Log(Log::Level::INFO) << "NUMA node: " << numaNode << ", threads pinned to " << numaCpus.size() << " CPUs";
+    }
+#else
+    numaNode = -1;
+#endif
+}
+
+bool BMDMemory::setupHugePages()
+{
+    segmentPageSize = pageSize;
+
+    if (hugePages == HugePages::NONE) return true;
+
+#if defined(__linux__)
+    if (hugePages == HugePages::TRANSPARENT)
+    {
+        // MADV_HUGEPAGE only has an effect on shared memory if the kernel allows huge pages for tmpfs
+        std::string shmemEnabled = readSysFile("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+
+        if (shmemEnabled.empty() ||
+            shmemEnabled.find("[never]") != std::string::npos ||
+            shmemEnabled.find("[deny]") != std::string::npos)
+        {
+            Log(Log::Level::ERR) << "Transparent huge pages are disabled for shared memory, set /sys/kernel/mm/transparent_hugepage/shmem_enabled to advise";
+            return false;
+        }
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outFrameDuration, sizeof(outFrameDuration)); // numerator
-    offset += sizeof(outFrameDuration);
+        segmentPageSize = strtoull(readSysFile("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size").c_str(), nullptr, 10);
+        if (segmentPageSize < pageSize) segmentPageSize = pageSize;
+    }
+    else
+    {
+        if (hugePagesPath.empty())
+        {
+            // the first hugetlbfs mount
+            std::ifstream mounts("/proc/mounts");
+            std::string device, path, type, line;
+
+            while (std::getline(mounts, line))
+            {
+                std::istringstream stream(line);
+
+                if (stream >> device >> path >> type && type == "hugetlbfs")
+                {
+                    hugePagesPath = path;
+                    break;
+                }
+            }
+
+            if (hugePagesPath.empty())
+            {
+                Log(Log::Level::ERR) << "No hugetlbfs mount found, mount one or pass it with --huge_pages_path";
+                return false;
+            }
+        }
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outTimeScale, sizeof(outTimeScale)); // denumerator
-    offset += sizeof(outTimeScale);
+        struct statfs fileSystem;
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outFieldDominance, sizeof(outFieldDominance));
-    offset += sizeof(outFieldDominance);
+        if (statfs(hugePagesPath.c_str(), &fileSystem) == -1 ||
+            fileSystem.f_type != HUGETLBFS_MAGIC)
+        {
+            Log(Log::Level::ERR) << hugePagesPath << " is not a hugetlbfs mount";
+            return false;
+        }
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outAudioSampleRate, sizeof(outAudioSampleRate));
-    offset += sizeof(outAudioSampleRate);
+        segmentPageSize = static_cast<uint64_t>(fileSystem.f_bsize);
+    }
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outAudioSampleDepth, sizeof(outAudioSampleDepth));
-    offset += sizeof(outAudioSampleDepth);
+    Log(Log::Level::INFO) << "Huge page size: " << segmentPageSize;
 
-    memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outAudioChannels, sizeof(outAudioChannels));
-    offset += sizeof(outAudioChannels);
+    return true;
+#else
+    Log(Log::Level::ERR) << "Huge pages are only supported on Linux";
+    return false;
+#endif
+}
 
-    uint32_t* currentOffset = &reinterpret_cast<uint32_t*>(sharedMemory)[0];
+bool BMDMemory::createSharedMemory()
+{
+    if (!setupHugePages() ||
+        !calculateLayout())
+    {
+        return false;
+    }
 
-    if (currentMetaDataOffset > *currentOffset)
+#if defined(__linux__)
+    if (hugePages == HugePages::HUGETLBFS)
     {
-        __sync_add_and_fetch(currentOffset, currentMetaDataOffset - *currentOffset);
+        // the mount may be shared with other applications, so check the pool before a mapping fails with SIGBUS or ENOMEM
+        std::string pool = "/sys/kernel/mm/hugepages/hugepages-" + std::to_string(segmentPageSize / 1024) + "kB/";
+        uint64_t freePages = strtoull(readSysFile(pool + "free_hugepages").c_str(), nullptr, 10);
+        uint64_t reservedPages = strtoull(readSysFile(pool + "resv_hugepages").c_str(), nullptr, 10);
+        uint64_t availablePages = (freePages > reservedPages) ? freePages - reservedPages : 0;
+        uint64_t neededPages = sharedMemorySize / segmentPageSize;
+
+        if (availablePages < neededPages)
+        {
+            Log(Log::Level::ERR) << "Not enough huge pages reserved, " << neededPages << " pages of " << segmentPageSize / 1024 <<
+                " kB needed, " << availablePages << " available, reserve more in " << pool << "nr_hugepages";
+            return false;
+        }
+
+        // POSIX shared memory names start with a slash
+        sharedMemoryPath = hugePagesPath + "/" + name.substr(name.find_first_not_of('/'));
+
+        unlink(sharedMemoryPath.c_str());
+
+        if ((sharedMemoryFd = open(sharedMemoryPath.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1)
+        {
+            Log(Log::Level::ERR) << "Failed to create shared memory file " << sharedMemoryPath;
+            sharedMemoryPath.clear();
+            return false;
+        }
     }
     else
+#endif
+    {
+        shm_unlink(name.c_str());
+
+        if ((sharedMemoryFd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR , S_IRUSR | S_IWUSR)) == -1)
+        {
+            Log(Log::Level::ERR) << "Failed to create shared memory";
+            return false;
+        }
+    }
+
+    if (ftruncate(sharedMemoryFd, sharedMemorySize) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to resize shared memory";
+        return false;
+    }
+
+    sharedMemory = mmap(nullptr, sharedMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, sharedMemoryFd, 0);
+
+    if (sharedMemory == MAP_FAILED)
     {
-        __sync_sub_and_fetch(currentOffset, *currentOffset - currentMetaDataOffset);
+        Log(Log::Level::ERR) << "Failed to map shared memory";
+        return false;
     }
 
-    currentMetaDataOffset = offset;
+#if defined(__linux__)
+    if (hugePages == HugePages::TRANSPARENT &&
+        madvise(sharedMemory, sharedMemorySize, MADV_HUGEPAGE) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to enable transparent huge pages for shared memory";
+        return false;
+    }
+#endif
+
+    // the memory policy only applies to pages that have not been faulted in yet
+    bindSharedMemory();
+    prefaultSharedMemory();
+
+    // fille header with zeros
+    memset(sharedMemory, 0, headerSize);
+
+    header = reinterpret_cast<bmdmemory::Header*>(sharedMemory);
+    header->version = bmdmemory::LAYOUT_VERSION;
+    header->headerSize = headerSize;
+    header->pageSize = static_cast<uint32_t>(segmentPageSize);
+    header->numaNode = numaNode;
+    header->size = sharedMemorySize;
+    header->latestFrame.slotsOffset = videoSlotsOffset + pageSize - sizeof(bmdmemory::VideoRecord);
+    header->latestFrame.slotSize = videoSlotSize;
+
+    // readers that see the magic number see a complete header
+    header->magic.store(bmdmemory::LAYOUT_MAGIC, std::memory_order_release);
+
+    videoIndex = reinterpret_cast<bmdmemory::IndexEntry*>(reinterpret_cast<uint8_t*>(sharedMemory) + videoIndexOffset);
+    audioIndex = reinterpret_cast<bmdmemory::IndexEntry*>(reinterpret_cast<uint8_t*>(sharedMemory) + audioIndexOffset);
+
+    return true;
+}
+
+void BMDMemory::bindSharedMemory()
+{
+#if defined(__linux__)
+    if (numaNode < 0) return;
+
+    std::vector<unsigned long> nodeMask(static_cast<size_t>(numaNode) / (sizeof(unsigned long) * 8) + 1);
+    nodeMask[static_cast<size_t>(numaNode) / (sizeof(unsigned long) * 8)] |= 1UL << (numaNode % (sizeof(unsigned long) * 8));
+
+    // preferred instead of bound, so that a full node falls back to another one instead of failing the fault
+    if (syscall(SYS_mbind, sharedMemory, sharedMemorySize, MPOL_PREFERRED, nodeMask.data(), nodeMask.size() * sizeof(unsigned long) * 8 + 1, MPOL_MF_MOVE) == -1)
+    {
+        Log(Log::Level::WARN) << "Failed to place shared memory on NUMA node " << numaNode << " - error: " << strerror(errno);
+    }
+#endif
+}
+
+void BMDMemory::prefaultSharedMemory()
+{
+    // fault in and lock every page before the streams start, so that the capture path never takes a page fault
+    auto start = std::chrono::steady_clock::now();
+
+    bool locked = mlock(sharedMemory, sharedMemorySize) == 0;
+
+    if (!locked)
+    {
+        Log(Log::Level::WARN) << "Failed to lock shared memory, it may be swapped out, raise RLIMIT_MEMLOCK or grant CAP_IPC_LOCK - error: " << strerror(errno);
+
+        // the segment was just created, so writing zeros only allocates the pages
+        volatile uint8_t* data = reinterpret_cast<volatile uint8_t*>(sharedMemory);
+
+        for (uint64_t offset = 0; offset < sharedMemorySize; offset += pageSize)
+        {
+            data[offset] = 0;
+        }
+    }
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    Log(Log::Level::INFO) << (locked ? "Prefaulted and locked " : "Prefaulted ") << sharedMemorySize / (1024 * 1024) << " MiB of shared memory in " << duration.count() << " ms";
+}
+
+void BMDMemory::writeMetaData()
+{
+    if (sizeof(bmdmemory::MetaDataRecord) + currentMetaDataOffset > metaDataOffset + metaDataSize ||
+        currentMetaDataOffset < metaDataOffset)
+    {
+        currentMetaDataOffset = metaDataOffset;
+    }
+
+    bmdmemory::MetaDataRecord* record = reinterpret_cast<bmdmemory::MetaDataRecord*>(reinterpret_cast<uint8_t*>(sharedMemory) + currentMetaDataOffset);
+
+    beginWrite(record->generation);
+
+    record->sequence = ++metaDataSequence;
+
+    switch (pixelFormat)
+    {
+        case bmdFormat8BitYUV: record->pixelFormat = 0; break;
+        case bmdFormat10BitYUV: record->pixelFormat = 1; break;
+        case bmdFormat8BitARGB: record->pixelFormat = 2; break;
+        case bmdFormat10BitRGB: record->pixelFormat = 3; break;
+        case bmdFormat12BitRGB: record->pixelFormat = 4; break;
+        case bmdFormat12BitRGBLE: record->pixelFormat = 5; break;
+        case bmdFormat10BitRGBXLE: record->pixelFormat = 6; break;
+        case bmdFormat10BitRGBX: record->pixelFormat = 7; break;
+        default: record->pixelFormat = 0; break;
+    }
+
+    record->width = static_cast<uint32_t>(width);
+    record->height = static_cast<uint32_t>(height);
+
+    record->frameDuration = static_cast<uint32_t>(frameDuration);
+    record->timeScale = static_cast<uint32_t>(timeScale);
+
+    switch (fieldDominance)
+    {
+        case bmdUnknownFieldDominance: record->fieldDominance = 0; break;
+        case bmdLowerFieldFirst: record->fieldDominance = 1; break;
+        case bmdUpperFieldFirst: record->fieldDominance = 2; break;
+        case bmdProgressiveFrame: record->fieldDominance = 3; break;
+        case bmdProgressiveSegmentedFrame: record->fieldDominance = 4; break;
+        default: record->fieldDominance = 0; break;
+    }
+
+    record->audioSampleRate = audioSampleRate;
+    record->audioSampleDepth = audioSampleDepth;
+    record->audioChannels = audioChannels;
+
+    record->videoSlotCount = videoSlotCount;
+    record->videoSlotSize = videoSlotSize;
+    record->audioIndexCount = audioIndexCount;
+    record->videoIndexOffset = videoIndexOffset;
+    record->videoSlotsOffset = videoSlotsOffset;
+    record->audioIndexOffset = audioIndexOffset;
+    record->audioDataOffset = audioDataOffset;
+    record->audioDataSize = audioDataSize;
+
+    endWrite(record->generation);
+
+    publish(header->metaData, record->sequence, currentMetaDataOffset);
+
+    currentMetaDataOffset += sizeof(bmdmemory::MetaDataRecord);
+
+    notifyReaders(EventNotifier::FORMAT);
 }
 
 bool BMDMemory::videoInputFormatChanged(BMDVideoInputFormatChangedEvents, IDeckLinkDisplayMode* newDisplayMode,
                                         BMDDetectedVideoInputFormatFlags)
 {
+    // handled by the writer thread after the frames queued so far
+    newDisplayMode->AddRef();
+
+    {
+        std::lock_guard<std::mutex> lock(displayModeMutex);
+
+        // a later change replaces one the writer has not applied yet
+        if (pendingDisplayMode) pendingDisplayMode->Release();
+
+        pendingDisplayMode = newDisplayMode;
+        pendingDisplayModeItem = queuedItems.load(std::memory_order_acquire);
+    }
+
+    wakeWriter();
+
+    return true;
+}
+
+bool BMDMemory::videoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame,
+                                       IDeckLinkAudioInputPacket* audioFrame)
+{
+    if (!callbackThreadPinned)
+    {
+        // the SDK may have created its callback thread before the affinity was set
+        pinThread(pthread_self(), numaCpus);
+        callbackThreadPinned = true;
+    }
+
+    WriterItem item;
+    item.videoFrame = videoFrame;
+    item.audioFrame = audioFrame;
+    item.arrivalTime.monotonicTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    item.arrivalTime.realTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+
+    BMDTimeValue hardwareTimestamp;
+    BMDTimeValue hardwareDuration;
+
+    // the audio packet of the callback arrived along with the video frame
+    if (videoFrame && videoFrame->GetHardwareReferenceTimestamp(1000000000, &hardwareTimestamp, &hardwareDuration) == S_OK)
+    {
+        item.arrivalTime.hardwareTimestamp = static_cast<uint64_t>(hardwareTimestamp);
+    }
+
+    // the SDK reuses the frames once the callback returns, unless they are referenced
+    if (videoFrame) videoFrame->AddRef();
+    if (audioFrame) audioFrame->AddRef();
+
+    if (!writerQueue.push(item))
+    {
+        if (videoFrame)
+        {
+            header->video.lost.fetch_add(1, std::memory_order_relaxed);
+            videoFrame->Release();
+        }
+
+        if (audioFrame)
+        {
+            header->audio.lost.fetch_add(1, std::memory_order_relaxed);
+            audioFrame->Release();
+        }
+
+        return false;
+    }
+
+    queuedItems.fetch_add(1, std::memory_order_release);
+
+    uint32_t depth = writerQueue.size();
+    if (depth > header->writerQueueHighWater.load(std::memory_order_relaxed))
+    {
+        header->writerQueueHighWater.store(depth, std::memory_order_relaxed);
+    }
+
+    wakeWriter();
+
+    return true;
+}
+
+void BMDMemory::runWriter()
+{
+    while (writerRunning.load())
+    {
+        uint32_t wakeups = writerWakeups.load();
+
+        applyDisplayModeChange();
+
+        WriterItem item;
+
+        if (writerQueue.pop(item))
+        {
+            ++dequeuedItems;
+            header->writerQueueDepth.store(writerQueue.size(), std::memory_order_relaxed);
+
+            uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+            uint64_t queueTime = now > item.arrivalTime.monotonicTime ? now - item.arrivalTime.monotonicTime : 0;
+
+            if (item.videoFrame) recordLatency(header->stats.video[bmdmemory::LATENCY_QUEUE], queueTime);
+            if (item.audioFrame) recordLatency(header->stats.audio[bmdmemory::LATENCY_QUEUE], queueTime);
+
+            writeFrames(item.videoFrame, item.audioFrame, item.arrivalTime);
+
+            if (item.videoFrame) item.videoFrame->Release();
+            if (item.audioFrame) item.audioFrame->Release();
+
+            continue;
+        }
+
+        // the callback wakes the writer only while it sleeps, the timeout retries the frames held back for the readers
+        writerSleeping.store(1);
+
+        if (writerQueue.size() == 0)
+        {
+#if defined(__linux__)
+            timespec timeout = { 0, 10000000 }; // 10 milliseconds
+            syscall(SYS_futex, &writerWakeups, FUTEX_WAIT_PRIVATE, wakeups, &timeout, nullptr, 0);
+#else
+            (void)wakeups;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+        }
+
+        writerSleeping.store(0);
+
+        if (!videoOverflowQueue.empty() || !audioOverflowQueue.empty())
+        {
+            flushOverflowQueues();
+            updateBacklog();
+        }
+    }
+}
+
+void BMDMemory::wakeWriter()
+{
+    writerWakeups.fetch_add(1);
+
+#if defined(__linux__)
+    if (writerSleeping.load())
+    {
+        syscall(SYS_futex, &writerWakeups, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+#endif
+}
+
+void BMDMemory::applyDisplayModeChange()
+{
+    IDeckLinkDisplayMode* newDisplayMode = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(displayModeMutex);
+
+        // the frames that arrived before the change are still written with the old mode
+        if (pendingDisplayMode && dequeuedItems >= pendingDisplayModeItem)
+        {
+            newDisplayMode = pendingDisplayMode;
+            pendingDisplayMode = nullptr;
+        }
+    }
+
+    if (newDisplayMode) changeDisplayMode(newDisplayMode);
+}
+
+void BMDMemory::changeDisplayMode(IDeckLinkDisplayMode* newDisplayMode)
+{
+    // the slots are sized for the mode negotiated at startup and can not grow while readers map them
+    uint64_t frameSize = static_cast<uint64_t>(getRowBytes(pixelFormat, static_cast<uint32_t>(newDisplayMode->GetWidth()))) * static_cast<uint64_t>(newDisplayMode->GetHeight());
+
+    if (frameSize > frameAllocator->getBufferSize())
+    {
+        Log(Log::Level::ERR) << "Video input changed to " << newDisplayMode->GetWidth() << "x" << newDisplayMode->GetHeight() <<
+            ", its " << frameSize << " byte frames do not fit in the " << frameAllocator->getBufferSize() << " byte slots, restart to capture it";
+        newDisplayMode->Release();
+        return;
+    }
+
+    // takes over the reference of the queued display mode
+    if (displayMode) displayMode->Release();
+    videoFrameTooLarge = false;
+
     displayMode = newDisplayMode;
     width = displayMode->GetWidth();
     height = displayMode->GetHeight();
     displayMode->GetFrameRate(&frameDuration, &timeScale);
     fieldDominance = displayMode->GetFieldDominance();
 
-    writeMetaData();
+    // stream times may start over with the new format
+    videoFormatChangePending = true;
+    audioFormatChangePending = true;
 
-    return S_OK;
+    writeMetaData();
 }
 
-bool BMDMemory::videoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame,
-                                       IDeckLinkAudioInputPacket* audioFrame)
+void BMDMemory::writeFrames(IDeckLinkVideoInputFrame* videoFrame,
+                            IDeckLinkAudioInputPacket* audioFrame,
+                            const ArrivalTime& arrivalTime)
 {
+    // frames kept while the readers were behind go first, so that the sequences stay in arrival order
+    flushOverflowQueues();
+
     if (videoFrame && (videoFrame->GetFlags() & static_cast<BMDFrameFlags>(bmdFrameHasNoInputSource)) == 0)
     {
-        void* frameData;
-        videoFrame->GetBytes(&frameData);
+        if (!videoOverflowQueue.empty() || !writeVideoFrame(videoFrame, arrivalTime))
+        {
+            if (videoOverflowQueue.size() < overflowQueueSize)
+            {
+                videoFrame->AddRef();
+                videoOverflowQueue.push_back(std::make_pair(videoFrame, arrivalTime));
+            }
+            else
+            {
+                header->video.lost.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    if (audioFrame)
+    {
+        if (!audioOverflowQueue.empty() || !writeAudioPacket(audioFrame, arrivalTime))
+        {
+            if (audioOverflowQueue.size() < overflowQueueSize)
+            {
+                audioFrame->AddRef();
+                audioOverflowQueue.push_back(std::make_pair(audioFrame, arrivalTime));
+            }
+            else
+            {
+                header->audio.lost.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    updateBacklog();
+}
+
+bool BMDMemory::writeVideoFrame(IDeckLinkVideoInputFrame* videoFrame, const ArrivalTime& arrivalTime)
+{
+    void* frameData;
+    videoFrame->GetBytes(&frameData);
 
-        BMDTimeValue duration;
-        BMDTimeValue timestamp;
-        videoFrame->GetStreamTime(&timestamp, &duration, timeScale);
+    BMDTimeValue duration;
+    BMDTimeValue timestamp;
+    videoFrame->GetStreamTime(&timestamp, &duration, timeScale);
 
-        uint64_t outTimestamp = static_cast<uint64_t>(timestamp);
-        uint32_t outDuration = static_cast<uint32_t>(duration);
-        uint32_t frameWidth = static_cast<uint32_t>(videoFrame->GetWidth());
-        uint32_t frameHeight = static_cast<uint32_t>(videoFrame->GetHeight());
-        uint32_t stride = static_cast<uint32_t>(videoFrame->GetRowBytes());
-        uint32_t dataSize = frameHeight * stride;
+    uint32_t frameWidth = static_cast<uint32_t>(videoFrame->GetWidth());
+    uint32_t frameHeight = static_cast<uint32_t>(videoFrame->GetHeight());
+    uint32_t stride = static_cast<uint32_t>(videoFrame->GetRowBytes());
+    uint32_t dataSize = frameHeight * stride;
 
-        if (sizeof(outTimestamp) +
-            sizeof(outDuration) +
-            sizeof(frameWidth) +
-            sizeof(frameHeight) +
-            sizeof(stride) +
-            sizeof(dataSize) +
-            dataSize +
-            headerSize +
-            currentVideoDataOffset > videoDataSize ||
-            currentVideoDataOffset < videoDataOffset)
+    uint8_t* data = reinterpret_cast<uint8_t*>(frameData);
+    bool copied = false;
+
+    // would never fit on a retry either, so it is not held back for the readers
+    if (dataSize > frameAllocator->getBufferSize())
+    {
+        if (!videoFrameTooLarge)
         {
-            currentVideoDataOffset = videoDataOffset;
+            Log(Log::Level::ERR) << "Video frame of " << dataSize << " bytes does not fit in the " << frameAllocator->getBufferSize() << " byte slots, dropping the frames of this mode";
+            videoFrameTooLarge = true;
         }
 
-        uint32_t offset = currentVideoDataOffset;
+        header->video.lost.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outTimestamp, sizeof(outTimestamp));
-        offset += sizeof(outTimestamp);
+    if (!frameAllocator->contains(data))
+    {
+        // the SDK did not use the allocator, so the frame has to be copied to a slot
+        data = frameAllocator->acquireBuffer(dataSize);
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outDuration, sizeof(outDuration));
-        offset += sizeof(outDuration);
+        if (!data)
+        {
+            // the slots hold frames the readers have not consumed yet, try again later
+            if (readerPolicy == ReaderPolicy::BACKPRESSURE) return false;
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &frameWidth, sizeof(frameWidth));
-        offset += sizeof(frameWidth);
+            Log(Log::Level::WARN) << "No free slot for video frame, dropping it";
+            header->video.lost.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &frameHeight, sizeof(frameHeight));
-        offset += sizeof(frameHeight);
+        uint64_t copyStart = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &stride, sizeof(stride));
-        offset += sizeof(stride);
+        if (copyPool && frameHeight > parallelCopyHeight)
+            copyPool->copy(data, frameData, stride, frameHeight);
+        else
+            copyFrame(data, frameData, dataSize);
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &dataSize, sizeof(dataSize));
-        offset += sizeof(dataSize);
+        recordLatency(header->stats.video[bmdmemory::LATENCY_COPY], static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()) - copyStart);
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, frameData, dataSize);
-        offset += dataSize;
+        copied = true;
+    }
+
+    uint64_t sequence = ++videoSequence;
+
+    // record header is stored right in front of the frame data, the allocator made its generation odd
+    currentVideoDataOffset = static_cast<uint64_t>(data - reinterpret_cast<uint8_t*>(sharedMemory)) - sizeof(bmdmemory::VideoRecord);
+
+    bmdmemory::VideoRecord* record = reinterpret_cast<bmdmemory::VideoRecord*>(reinterpret_cast<uint8_t*>(sharedMemory) + currentVideoDataOffset);
+
+    record->sequence = sequence;
+    record->timestamp = static_cast<uint64_t>(timestamp);
+    record->duration = static_cast<uint32_t>(duration);
+    record->width = frameWidth;
+    record->height = frameHeight;
+    record->stride = stride;
+    record->dataSize = dataSize;
+    record->reserved = 0;
+    record->hardwareTimestamp = arrivalTime.hardwareTimestamp;
+    record->arrivalTime = arrivalTime.monotonicTime;
+    record->arrivalRealTime = arrivalTime.realTime;
+
+    endWrite(record->generation);
+
+    uint32_t flags = 0;
+    if (videoFormatChangePending) flags |= bmdmemory::INDEX_FORMAT_CHANGED;
+    videoFormatChangePending = false;
+
+    // index entry of the sequence, readers find a frame by its sequence or its timestamp without walking the ring
+    writeIndexEntry(videoIndex[sequence % videoSlotCount], sequence, currentVideoDataOffset,
+                    static_cast<uint64_t>(timestamp), arrivalTime.hardwareTimestamp, flags);
 
-        uint32_t* currentOffset = &reinterpret_cast<uint32_t*>(sharedMemory)[1];
+    publish(header->video, sequence, currentVideoDataOffset);
 
-        if (currentVideoDataOffset > *currentOffset)
+    // slot and sequence in one word, readers that only want the newest frame need a single load
+    uint64_t slot = (currentVideoDataOffset - header->latestFrame.slotsOffset) / videoSlotSize;
+    header->latestFrame.descriptor.store((slot << bmdmemory::LATEST_FRAME_SEQUENCE_BITS) | bmdmemory::getLatestFrameSequence(sequence),
+                                         std::memory_order_release);
+
+    recordArrival(header->stats.video, arrivalTime, lastVideoArrival,
+                  static_cast<uint64_t>(timestamp), lastVideoTimestamp, static_cast<uint64_t>(timeScale));
+
+    updateReaders(bmdmemory::STREAM_VIDEO, sequence);
+
+    frameAllocator->publishBuffer(data, sequence);
+
+    if (copied) frameAllocator->releaseBuffer(data);
+
+    notifyReaders(EventNotifier::VIDEO);
+
+    return true;
+}
+
+bool BMDMemory::writeAudioPacket(IDeckLinkAudioInputPacket* audioFrame, const ArrivalTime& arrivalTime)
+{
+    void* frameData;
+
+    audioFrame->GetBytes(&frameData);
+
+    BMDTimeValue timestamp;
+    audioFrame->GetPacketTime(&timestamp, audioSampleRate);
+
+    uint32_t sampleFrameCount = static_cast<uint32_t>(audioFrame->GetSampleFrameCount());
+    uint32_t dataSize = sampleFrameCount * audioChannels * (audioSampleDepth / 8);
+
+    // records are kept 8 byte aligned, so that the generation can be accessed atomically
+    uint64_t recordSize = (sizeof(bmdmemory::AudioRecord) + dataSize + 7) / 8 * 8;
+
+    // a packet longer than the whole region would be written past its end after the wrap
+    if (recordSize > audioDataSize)
+    {
+        if (!audioPacketTooLarge)
         {
-            __sync_add_and_fetch(currentOffset, currentVideoDataOffset - *currentOffset);
+            Log(Log::Level::WARN) << "Audio packet of " << recordSize << " bytes does not fit in the " << audioDataSize << " byte audio region, dropping it";
+            audioPacketTooLarge = true;
         }
-        else
+
+        header->audio.lost.fetch_add(1, std::memory_order_relaxed);
+
+        // dropped rather than returned as unwritten, it would never fit on a retry either
+        return true;
+    }
+
+    bool wrap = recordSize + currentAudioDataOffset > audioDataOffset + audioDataSize ||
+        currentAudioDataOffset < audioDataOffset;
+
+    if (readerPolicy == ReaderPolicy::BACKPRESSURE)
+    {
+        uint64_t consumed = getConsumedSequence(bmdmemory::STREAM_AUDIO);
+
+        if (wrap)
         {
-            __sync_sub_and_fetch(currentOffset, *currentOffset - currentVideoDataOffset);
+            // after the wrap the new record overwrites the start of the current lap
+            if (!audioRecordsConsumed(audioTailOffset, audioTailEndOffset, audioDataOffset + audioDataSize, consumed) ||
+                !audioRecordsConsumed(audioDataOffset, currentAudioDataOffset, audioDataOffset + recordSize, consumed))
+                return false;
         }
+        else if (!audioRecordsConsumed(audioTailOffset, audioTailEndOffset, currentAudioDataOffset + recordSize, consumed))
+            return false;
+    }
 
-        currentVideoDataOffset = offset;
+    if (wrap)
+    {
+        // records of the previous lap after the wrap point will be overwritten by the next lap
+        invalidateAudioRecords(audioDataOffset + audioDataSize);
+
+        audioTailOffset = audioDataOffset;
+        audioTailEndOffset = currentAudioDataOffset;
+        currentAudioDataOffset = audioDataOffset;
     }
 
-    if (audioFrame)
+    invalidateAudioRecords(currentAudioDataOffset + recordSize);
+
+    bmdmemory::AudioRecord* record = reinterpret_cast<bmdmemory::AudioRecord*>(reinterpret_cast<uint8_t*>(sharedMemory) + currentAudioDataOffset);
+
+    beginWrite(record->generation);
+
+    record->sequence = ++audioSequence;
+    record->timestamp = static_cast<uint64_t>(timestamp);
+    record->sampleFrameCount = sampleFrameCount;
+    record->dataSize = dataSize;
+    record->hardwareTimestamp = arrivalTime.hardwareTimestamp;
+    record->arrivalTime = arrivalTime.monotonicTime;
+    record->arrivalRealTime = arrivalTime.realTime;
+
+    uint64_t copyStart = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+
+    memcpy(reinterpret_cast<uint8_t*>(record) + sizeof(bmdmemory::AudioRecord), frameData, dataSize);
+
+    recordLatency(header->stats.audio[bmdmemory::LATENCY_COPY], static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()) - copyStart);
+
+    endWrite(record->generation);
+
+    writeIndexEntry(audioIndex[record->sequence % audioIndexCount], record->sequence, currentAudioDataOffset,
+                    record->timestamp, 0, audioFormatChangePending ? bmdmemory::INDEX_FORMAT_CHANGED : 0);
+    audioFormatChangePending = false;
+
+    publish(header->audio, record->sequence, currentAudioDataOffset);
+
+    recordArrival(header->stats.audio, arrivalTime, lastAudioArrival,
+                  static_cast<uint64_t>(timestamp), lastAudioTimestamp, static_cast<uint64_t>(audioSampleRate));
+
+    updateReaders(bmdmemory::STREAM_AUDIO, record->sequence);
+
+    currentAudioDataOffset += recordSize;
+
+    notifyReaders(EventNotifier::AUDIO);
+
+    return true;
+}
+
+void BMDMemory::recordArrival(bmdmemory::LatencyHistogram* histograms, const ArrivalTime& arrivalTime, uint64_t& lastArrival,
+                              uint64_t timestamp, uint64_t& lastTimestamp, uint64_t timeScale)
+{
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+
+    recordLatency(histograms[bmdmemory::LATENCY_PUBLISH], now > arrivalTime.monotonicTime ? now - arrivalTime.monotonicTime : 0);
+
+    // how far the wall clock interval between two records strays from the interval the SDK reports for them
+    if (lastArrival && timestamp > lastTimestamp && timeScale)
+    {
+        uint64_t arrivalInterval = arrivalTime.monotonicTime - lastArrival;
+        uint64_t streamInterval = (timestamp - lastTimestamp) * 1000000000ULL / timeScale;
+
+        recordLatency(histograms[bmdmemory::LATENCY_JITTER], arrivalInterval > streamInterval ? arrivalInterval - streamInterval : streamInterval - arrivalInterval);
+    }
+
+    lastArrival = arrivalTime.monotonicTime;
+    lastTimestamp = timestamp;
+}
+
+void BMDMemory::flushOverflowQueues()
+{
+    while (!videoOverflowQueue.empty() && writeVideoFrame(videoOverflowQueue.front().first, videoOverflowQueue.front().second))
     {
-        void* frameData;
+        videoOverflowQueue.front().first->Release();
+        videoOverflowQueue.pop_front();
+    }
 
-        audioFrame->GetBytes(&frameData);
+    while (!audioOverflowQueue.empty() && writeAudioPacket(audioOverflowQueue.front().first, audioOverflowQueue.front().second))
+    {
+        audioOverflowQueue.front().first->Release();
+        audioOverflowQueue.pop_front();
+    }
+}
 
-        BMDTimeValue timestamp;
-        audioFrame->GetPacketTime(&timestamp, audioSampleRate);
+void BMDMemory::updateBacklog()
+{
+    header->video.queued.store(static_cast<uint32_t>(videoOverflowQueue.size()), std::memory_order_relaxed);
+    header->audio.queued.store(static_cast<uint32_t>(audioOverflowQueue.size()), std::memory_order_relaxed);
 
-        uint64_t outTimestamp = static_cast<uint64_t>(timestamp);
-        uint32_t sampleFrameCount = static_cast<uint32_t>(audioFrame->GetSampleFrameCount());
-        uint32_t dataSize = sampleFrameCount * audioChannels * (audioSampleDepth / 8);
+    // frames and samples the SDK has captured but not delivered to the callback yet
+    uint32_t videoFrameCount = 0;
+    if (deckLinkInput->GetAvailableVideoFrameCount(&videoFrameCount) == S_OK)
+    {
+        header->video.backlog.store(videoFrameCount, std::memory_order_relaxed);
+    }
 
-        if (sizeof(outTimestamp) +
-            sizeof(sampleFrameCount) +
-            sizeof(dataSize) +
-            dataSize +
-            currentAudioDataOffset > audioDataSize ||
-            currentAudioDataOffset < audioDataOffset)
-        {
-            currentAudioDataOffset = audioDataOffset;
-        }
+    uint32_t audioSampleFrameCount = 0;
+    if (deckLinkInput->GetAvailableAudioSampleFrameCount(&audioSampleFrameCount) == S_OK)
+    {
+        header->audio.backlog.store(audioSampleFrameCount, std::memory_order_relaxed);
+    }
 
-        uint32_t offset = currentAudioDataOffset;
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &outTimestamp, sizeof(outTimestamp));
-        offset += sizeof(outTimestamp);
+    if (now - lastBacklogReport < 1000000000ULL) return; // once per second
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &sampleFrameCount, sizeof(sampleFrameCount));
-        offset += sizeof(sampleFrameCount);
+    lastBacklogReport = now;
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, &dataSize, sizeof(dataSize));
-        offset += sizeof(dataSize);
+    uint64_t videoLost = header->video.lost.load(std::memory_order_relaxed);
+    uint64_t audioLost = header->audio.lost.load(std::memory_order_relaxed);
 
-        memcpy(reinterpret_cast<uint8_t*>(sharedMemory) + offset, frameData, dataSize);
-        offset += dataSize;
+    uint32_t writerQueueHighWater = header->writerQueueHighWater.load(std::memory_order_relaxed);
 
-        uint32_t* currentOffset = &reinterpret_cast<uint32_t*>(sharedMemory)[2];
+    if (writerQueueHighWater != reportedWriterQueueHighWater)
+    {
+        Log(Log::Level::WARN) << "Writer queue depth: " << header->writerQueueDepth.load(std::memory_order_relaxed) <<
+            ", high-water mark: " << writerQueueHighWater << " of " << writerQueue.capacity();
+
+        reportedWriterQueueHighWater = writerQueueHighWater;
+    }
+
+    if (videoLost != reportedVideoLost || audioLost != reportedAudioLost)
+    {
+        Log(Log::Level::WARN) << "Frames lost, video: " << videoLost << ", audio: " << audioLost <<
+            ", video queued: " << videoOverflowQueue.size() << ", audio queued: " << audioOverflowQueue.size() <<
+            ", SDK video backlog: " << videoFrameCount << ", SDK audio backlog: " << audioSampleFrameCount;
+
+        reportedVideoLost = videoLost;
+        reportedAudioLost = audioLost;
+    }
+}
 
-        if (currentAudioDataOffset > *currentOffset)
+void BMDMemory::invalidateAudioRecords(uint64_t endOffset)
+{
+    // make the generation of every old record that is about to be overwritten odd
+    while (audioTailOffset < audioTailEndOffset &&
+           audioTailOffset < endOffset)
+    {
+        bmdmemory::AudioRecord* record = reinterpret_cast<bmdmemory::AudioRecord*>(reinterpret_cast<uint8_t*>(sharedMemory) + audioTailOffset);
+
+        // records are variable length, so the offset of a stale entry may point into the samples of a newer record
+        uint64_t sequence = record->sequence;
+        audioIndex[sequence % audioIndexCount].sequence.compare_exchange_strong(sequence, 0);
+
+        record->generation.store(record->generation.load(std::memory_order_relaxed) | 1, std::memory_order_relaxed);
+
+        countOverruns(bmdmemory::STREAM_AUDIO, record->sequence);
+
+        audioTailOffset += (sizeof(bmdmemory::AudioRecord) + record->dataSize + 7) / 8 * 8;
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+bool BMDMemory::audioRecordsConsumed(uint64_t offset, uint64_t tailEndOffset, uint64_t endOffset, uint64_t consumed) const
+{
+    // walks the records that writing up to the end offset would overwrite, like invalidateAudioRecords does
+    while (offset < tailEndOffset &&
+           offset < endOffset)
+    {
+        const bmdmemory::AudioRecord* record = reinterpret_cast<const bmdmemory::AudioRecord*>(reinterpret_cast<const uint8_t*>(sharedMemory) + offset);
+
+        if (record->sequence > consumed) return false;
+
+        offset += (sizeof(bmdmemory::AudioRecord) + record->dataSize + 7) / 8 * 8;
+    }
+
+    return true;
+}
+
+uint64_t BMDMemory::getConsumedSequence(uint32_t stream) const
+{
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    uint64_t result = UINT64_MAX;
+
+    // the slowest active reader of the stream, readers that stopped sending heartbeats do not hold the writer back
+    for (const bmdmemory::ReaderCursor& reader : header->readers)
+    {
+        if (reader.state.load(std::memory_order_acquire) != bmdmemory::READER_ACTIVE ||
+            !(reader.streams & stream)) continue;
+
+        uint64_t heartbeat = reader.heartbeat.load(std::memory_order_relaxed);
+
+        if (now > heartbeat && now - heartbeat > readerTimeout) continue;
+
+        uint64_t consumed = (stream == bmdmemory::STREAM_VIDEO) ?
+            reader.videoSequence.load(std::memory_order_acquire) :
+            reader.audioSequence.load(std::memory_order_acquire);
+
+        if (consumed < result) result = consumed;
+    }
+
+    return result;
+}
+
+void BMDMemory::updateReaders(uint32_t stream, uint64_t sequence)
+{
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    bool report = now - lastReaderReport >= 1000000000ULL; // once per second
+
+    if (report) lastReaderReport = now;
+
+    for (uint32_t i = 0; i < bmdmemory::MAX_READERS; ++i)
+    {
+        bmdmemory::ReaderCursor& reader = header->readers[i];
+        uint32_t state = reader.state.load(std::memory_order_acquire);
+
+        if (state != bmdmemory::READER_ACTIVE &&
+            state != bmdmemory::READER_DROPPED) continue;
+
+        uint64_t heartbeat = reader.heartbeat.load(std::memory_order_relaxed);
+
+        if (now > heartbeat && now - heartbeat > readerTimeout)
         {
-            __sync_add_and_fetch(currentOffset, currentAudioDataOffset - *currentOffset);
+            // the reader has exited or hangs, free its cursor for others
+            if (reader.state.compare_exchange_strong(state, bmdmemory::READER_FREE))
+            {
+                Log(Log::Level::WARN) << "Reader " << reader.pid << " timed out";
+            }
+
+            continue;
+        }
+
+        if (state != bmdmemory::READER_ACTIVE || !(reader.streams & stream)) continue;
+
+        if (stream == bmdmemory::STREAM_VIDEO)
+        {
+            uint64_t consumed = reader.videoSequence.load(std::memory_order_relaxed);
+            reader.videoLag.store(sequence > consumed ? sequence - consumed : 0, std::memory_order_relaxed);
         }
         else
         {
-            __sync_sub_and_fetch(currentOffset, *currentOffset - currentAudioDataOffset);
+            uint64_t consumed = reader.audioSequence.load(std::memory_order_relaxed);
+            reader.audioLag.store(sequence > consumed ? sequence - consumed : 0, std::memory_order_relaxed);
         }
 
-        currentAudioDataOffset = offset;
+        if (report)
+        {
+            uint64_t overruns = reader.videoOverruns.load(std::memory_order_relaxed) + reader.audioOverruns.load(std::memory_order_relaxed);
+
+            if (overruns != readerOverruns[i])
+            {
+                Log(Log::Level::WARN) << "Reader " << reader.pid << " is falling behind, video lag: " << reader.videoLag.load(std::memory_order_relaxed) <<
+                    ", audio lag: " << reader.audioLag.load(std::memory_order_relaxed) <<
+                    ", video overruns: " << reader.videoOverruns.load(std::memory_order_relaxed) <<
+                    ", audio overruns: " << reader.audioOverruns.load(std::memory_order_relaxed);
+
+                readerOverruns[i] = overruns;
+            }
+        }
     }
+}
 
-    return true;
+void BMDMemory::countOverruns(uint32_t stream, uint64_t sequence)
+{
+    // called for every record that is overwritten
+    for (bmdmemory::ReaderCursor& reader : header->readers)
+    {
+        if (reader.state.load(std::memory_order_acquire) != bmdmemory::READER_ACTIVE ||
+            !(reader.streams & stream)) continue;
+
+        uint64_t consumed = (stream == bmdmemory::STREAM_VIDEO) ?
+            reader.videoSequence.load(std::memory_order_relaxed) :
+            reader.audioSequence.load(std::memory_order_relaxed);
+
+        if (consumed >= sequence) continue;
+
+        if (stream == bmdmemory::STREAM_VIDEO)
+            reader.videoOverruns.fetch_add(1, std::memory_order_relaxed);
+        else
+            reader.audioOverruns.fetch_add(1, std::memory_order_relaxed);
+
+        if (readerPolicy == ReaderPolicy::DROP)
+        {
+            uint32_t state = bmdmemory::READER_ACTIVE;
+
+            if (reader.state.compare_exchange_strong(state, bmdmemory::READER_DROPPED))
+            {
+                Log(Log::Level::WARN) << "Reader " << reader.pid << " dropped, data it has not consumed was overwritten";
+            }
+        }
+    }
+}
+
+void BMDMemory::notifyReaders(uint32_t event)
+{
+    // readers increment the waiter count before they check the counter and go to sleep on it
+    header->frameCounter.fetch_add(1, std::memory_order_seq_cst);
+
+#if defined(__linux__)
+    if (header->waiterCount.load(std::memory_order_seq_cst) > 0)
+    {
+        syscall(SYS_futex, &header->frameCounter, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+#endif
+
+    if (eventNotifier) eventNotifier->notify(event);
 }
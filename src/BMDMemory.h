@@ -4,33 +4,116 @@
 
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
 #include <sys/mman.h>
 #include "DeckLinkAPI.h"
+#include "CopyPool.h"
+#include "EventNotifier.h"
+#include "FrameCopy.h"
+#include "SPSCQueue.h"
+#include "bmdmemory/layout.h"
 
-class InputCallback;
+template <class T> class InputCallback;
+class FrameAllocator;
 
 class BMDMemory
 {
 public:
+    enum class ReaderPolicy
+    {
+        NONE, // only count overruns
+        DROP, // drop readers that have missed data
+        BACKPRESSURE // never overwrite data the readers have not consumed, queue frames instead
+    };
+
+    enum class HugePages
+    {
+        NONE,
+        TRANSPARENT, // MADV_HUGEPAGE on the POSIX shared memory object
+        HUGETLBFS // segment file on a hugetlbfs mount
+    };
+
     BMDMemory(const std::string& pName,
               int32_t pInstance,
               int32_t pVideoMode,
               int32_t pVideoConnection,
               int32_t pVideoFormat,
-              int32_t pAudioConnection);
+              int32_t pAudioConnection,
+              uint32_t pVideoSlotCount,
+              uint32_t pHistoryDuration,
+              uint64_t pAudioDataSize,
+              uint64_t pMemorySize,
+              const std::string& pEventSocketPath,
+              ReaderPolicy pReaderPolicy,
+              uint32_t pOverflowQueueSize,
+              HugePages pHugePages,
+              const std::string& pHugePagesPath,
+              int32_t pNumaNode,
+              const std::string& pCopyKernel,
+              uint32_t pCopyThreadCount,
+              uint32_t pWriterQueueSize,
+              int32_t pRtPriority,
+              const std::string& pCpuAffinity);
     virtual ~BMDMemory();
 
     bool run();
 
+    // logs the per call overhead of the SDK callback
+    static void benchmarkCallback(uint32_t iterations);
+
 protected:
+    template <class T> friend class InputCallback;
+
     bool videoInputFormatChanged(BMDVideoInputFormatChangedEvents,
                                  IDeckLinkDisplayMode* newDisplayMode,
                                  BMDDetectedVideoInputFormatFlags);
 
     bool videoInputFrameArrived(IDeckLinkVideoInputFrame* videoFrame,
                                 IDeckLinkAudioInputPacket* audioFrame);
-    
+
+    void runWriter();
+    void wakeWriter();
+    void applyDisplayModeChange();
+    void changeDisplayMode(IDeckLinkDisplayMode* newDisplayMode);
+
+    // taken in the SDK callback, all in nanoseconds
+    struct ArrivalTime
+    {
+        uint64_t hardwareTimestamp = 0; // hardware reference clock of the card when the video frame arrived
+        uint64_t monotonicTime = 0; // steady clock, CLOCK_MONOTONIC on Linux
+        uint64_t realTime = 0; // system clock, CLOCK_REALTIME
+    };
+
+    void writeFrames(IDeckLinkVideoInputFrame* videoFrame,
+                     IDeckLinkAudioInputPacket* audioFrame,
+                     const ArrivalTime& arrivalTime);
+
+    void setupNuma();
+    void setupThread(pthread_t thread, const char* threadName);
+    bool setupHugePages();
+    bool calculateLayout();
+    bool createSharedMemory();
+    void bindSharedMemory();
+    void prefaultSharedMemory();
     void writeMetaData();
+    bool writeVideoFrame(IDeckLinkVideoInputFrame* videoFrame, const ArrivalTime& arrivalTime);
+    bool writeAudioPacket(IDeckLinkAudioInputPacket* audioFrame, const ArrivalTime& arrivalTime);
+    void recordArrival(bmdmemory::LatencyHistogram* histograms, const ArrivalTime& arrivalTime, uint64_t& lastArrival,
+                       uint64_t timestamp, uint64_t& lastTimestamp, uint64_t timeScale);
+    void flushOverflowQueues();
+    void updateBacklog();
+    void invalidateAudioRecords(uint64_t endOffset);
+    bool audioRecordsConsumed(uint64_t offset, uint64_t tailEndOffset, uint64_t endOffset, uint64_t consumed) const;
+    uint64_t getConsumedSequence(uint32_t stream) const;
+    void updateReaders(uint32_t stream, uint64_t sequence);
+    void countOverruns(uint32_t stream, uint64_t sequence);
+    void notifyReaders(uint32_t event);
 
     std::string name;
     int32_t instance = 0;
@@ -39,26 +122,118 @@ protected:
     int32_t videoFormat = 0;
     int32_t audioConnection = 0;
 
+    // 0 when the region has to be sized automatically
+    uint32_t videoSlotCount = 0;
+    uint32_t historyDuration = 0; // milliseconds
+    uint64_t requestedAudioDataSize = 0;
+    uint64_t requestedMemorySize = 0;
+    const uint32_t defaultVideoSlotCount = 16;
+    std::string eventSocketPath;
+
+    ReaderPolicy readerPolicy = ReaderPolicy::NONE;
+    const uint64_t readerTimeout = 5000000000ULL; // 5 seconds
+    uint64_t lastReaderReport = 0;
+    uint64_t readerOverruns[bmdmemory::MAX_READERS] = {};
+
+    // frames kept while the readers are behind in the BACKPRESSURE policy
+    uint32_t overflowQueueSize = 0;
+    std::deque<std::pair<IDeckLinkVideoInputFrame*, ArrivalTime>> videoOverflowQueue;
+    std::deque<std::pair<IDeckLinkAudioInputPacket*, ArrivalTime>> audioOverflowQueue;
+    uint64_t lastBacklogReport = 0;
+    uint64_t reportedVideoLost = 0;
+    uint64_t reportedAudioLost = 0;
+
+    const uint32_t pageSize;
+
+    int32_t numaNode = -1; // node of the card, -1 if unknown
+    std::vector<uint32_t> numaCpus; // CPUs of the node, bmdmemory threads are pinned to them
+    bool callbackThreadPinned = false;
+
+    std::string copyKernel; // name of the frame copy kernel, the widest one the CPU supports if empty
+    FrameCopy::Function copyFrame = nullptr;
+
+    // frames taller than the limit are copied in stripes by the pool, smaller ones are not worth waking the threads
+    uint32_t copyThreadCount = 1;
+    const uint32_t parallelCopyHeight = 1080;
+    std::unique_ptr<CopyPool> copyPool;
+
+    // callbacks of the SDK are queued and handled by the writer thread, so that the SDK thread never waits for a copy
+    struct WriterItem
+    {
+        IDeckLinkVideoInputFrame* videoFrame = nullptr;
+        IDeckLinkAudioInputPacket* audioFrame = nullptr;
+        ArrivalTime arrivalTime;
+    };
+
+    // only the frame callback pushes, the SDK does not promise to call the format change callback on the same thread
+    SPSCQueue<WriterItem> writerQueue;
+    std::atomic<uint64_t> queuedItems{0};
+    uint64_t dequeuedItems = 0; // writer thread only
+
+    // format changes take effect once the writer has dequeued the frames that arrived before them
+    std::mutex displayModeMutex;
+    IDeckLinkDisplayMode* pendingDisplayMode = nullptr;
+    uint64_t pendingDisplayModeItem = 0;
+    std::thread writerThread;
+    std::atomic<bool> writerRunning{false};
+    std::atomic<uint32_t> writerWakeups{0}; // futex word of the writer thread
+    std::atomic<uint32_t> writerSleeping{0};
+    uint32_t reportedWriterQueueHighWater = 0;
+
+    // previous records for the jitter histograms
+    uint64_t lastVideoArrival = 0;
+    uint64_t lastVideoTimestamp = 0;
+    uint64_t lastAudioArrival = 0;
+    uint64_t lastAudioTimestamp = 0;
+
+    // applied to the writer and copy threads
+    int32_t rtPriority = 0; // SCHED_FIFO priority, 0 for the default policy
+    std::vector<uint32_t> cpuAffinity; // the CPUs of the card's NUMA node if empty
+
+    HugePages hugePages = HugePages::NONE;
+    std::string hugePagesPath; // hugetlbfs mount, found in /proc/mounts if empty
+    uint64_t segmentPageSize = 0; // size of the pages backing the segment
+
     int sharedMemoryFd = -1;
+    std::string sharedMemoryPath; // file on the hugetlbfs mount, empty for POSIX shared memory
     void* sharedMemory = MAP_FAILED;
-    const uint32_t sharedMemorySize = 128 * 1024 * 1024; // 128 MiB
+    uint64_t sharedMemorySize = 0;
+    bmdmemory::Header* header = nullptr;
 
     const uint32_t headerSize;
 
-    uint32_t currentMetaDataOffset = 0;
-    uint32_t currentVideoDataOffset = 0;
-    uint32_t currentAudioDataOffset = 0;
+    uint64_t currentMetaDataOffset = 0;
+    uint64_t currentVideoDataOffset = 0;
+    uint64_t currentAudioDataOffset = 0;
 
-    const uint32_t metaDataOffset;
+    const uint64_t metaDataOffset;
     const uint32_t metaDataSize;
-
-    const uint32_t videoDataOffset;
-    const uint32_t videoDataSize;
-
-    const uint32_t audioDataOffset;
-    const uint32_t audioDataSize;
-
-    InputCallback* inputCallback = nullptr;
+    uint64_t metaDataSequence = 0;
+
+    uint64_t videoDataOffset = 0;
+    uint64_t videoDataSize = 0;
+    uint64_t videoIndexOffset = 0;
+    uint64_t videoSlotsOffset = 0;
+    uint32_t videoSlotSize = 0;
+    bmdmemory::IndexEntry* videoIndex = nullptr;
+    uint64_t videoSequence = 0;
+    bool videoFormatChangePending = false; // the next frame is flagged in the index
+    bool videoFrameTooLarge = false; // logged only once
+
+    uint64_t audioIndexOffset = 0;
+    uint32_t audioIndexCount = 0;
+    bmdmemory::IndexEntry* audioIndex = nullptr;
+    bool audioFormatChangePending = false;
+    uint64_t audioDataOffset = 0;
+    uint64_t audioDataSize = 0;
+    uint64_t audioSequence = 0;
+    uint64_t audioTailOffset = 0;
+    uint64_t audioTailEndOffset = 0;
+    bool audioPacketTooLarge = false; // logged only once
+
+    InputCallback<BMDMemory>* inputCallback = nullptr;
+    FrameAllocator* frameAllocator = nullptr;
+    std::unique_ptr<EventNotifier> eventNotifier;
 
     IDeckLink* deckLink = nullptr;
     IDeckLinkInput* deckLinkInput = nullptr;
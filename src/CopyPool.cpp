@@ -0,0 +1,97 @@
+//
+//  BMD memory
+//
+
+#include "CopyPool.h"
+
+CopyPool::CopyPool(uint32_t pThreadCount, FrameCopy::Function pCopyFrame):
+    copyFrame(pCopyFrame)
+{
+    // the calling thread copies the first stripe
+    for (uint32_t stripe = 1; stripe < pThreadCount; ++stripe)
+    {
+        threads.push_back(std::thread(&CopyPool::run, this, stripe));
+    }
+}
+
+CopyPool::~CopyPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stop = true;
+    }
+
+    startCondition.notify_all();
+
+    for (std::thread& thread : threads) thread.join();
+}
+
+std::vector<std::thread::native_handle_type> CopyPool::getNativeHandles()
+{
+    std::vector<std::thread::native_handle_type> handles;
+
+    for (std::thread& thread : threads) handles.push_back(thread.native_handle());
+
+    return handles;
+}
+
+void CopyPool::copy(void* destination, const void* source, size_t rowBytes, size_t rowCount)
+{
+    Job currentJob;
+    currentJob.destination = static_cast<uint8_t*>(destination);
+    currentJob.source = static_cast<const uint8_t*>(source);
+    currentJob.rowBytes = rowBytes;
+    currentJob.rowCount = rowCount;
+
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        job = currentJob;
+        pending = static_cast<uint32_t>(threads.size());
+        ++generation;
+    }
+
+    startCondition.notify_all();
+
+    copyStripe(currentJob, 0);
+
+    // the kernels fence their streaming stores, the mutex makes the stripes of the other threads visible to the caller
+    std::unique_lock<std::mutex> lock(jobMutex);
+    doneCondition.wait(lock, [this] { return pending == 0; });
+}
+
+void CopyPool::run(uint32_t stripe)
+{
+    uint64_t lastGeneration = 0;
+
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lock(jobMutex);
+        startCondition.wait(lock, [this, lastGeneration] { return stop || generation != lastGeneration; });
+
+        if (stop) break;
+
+        lastGeneration = generation;
+        Job currentJob = job;
+        lock.unlock();
+
+        copyStripe(currentJob, stripe);
+
+        lock.lock();
+        if (--pending == 0) doneCondition.notify_one();
+    }
+}
+
+void CopyPool::copyStripe(const Job& currentJob, uint32_t stripe)
+{
+    // stripes are whole rows, so that every thread writes its own range of cache lines
+    size_t stripeCount = threads.size() + 1;
+    size_t firstRow = currentJob.rowCount * stripe / stripeCount;
+    size_t lastRow = currentJob.rowCount * (stripe + 1) / stripeCount;
+
+    if (lastRow > firstRow)
+    {
+        copyFrame(currentJob.destination + firstRow * currentJob.rowBytes,
+                  currentJob.source + firstRow * currentJob.rowBytes,
+                  (lastRow - firstRow) * currentJob.rowBytes);
+    }
+}
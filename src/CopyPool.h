@@ -0,0 +1,50 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "FrameCopy.h"
+
+// persistent threads that copy a frame in stripes of rows together with the calling thread
+class CopyPool
+{
+public:
+    CopyPool(uint32_t pThreadCount, FrameCopy::Function pCopyFrame);
+    virtual ~CopyPool();
+
+    // returns after every stripe has been copied
+    void copy(void* destination, const void* source, size_t rowBytes, size_t rowCount);
+
+    uint32_t getThreadCount() const { return static_cast<uint32_t>(threads.size()) + 1; }
+    std::vector<std::thread::native_handle_type> getNativeHandles();
+
+protected:
+    struct Job
+    {
+        uint8_t* destination = nullptr;
+        const uint8_t* source = nullptr;
+        size_t rowBytes = 0;
+        size_t rowCount = 0;
+    };
+
+    void run(uint32_t stripe);
+    void copyStripe(const Job& currentJob, uint32_t stripe);
+
+    FrameCopy::Function copyFrame;
+
+    std::mutex jobMutex;
+    std::condition_variable startCondition;
+    std::condition_variable doneCondition;
+    Job job;
+    uint64_t generation = 0;
+    uint32_t pending = 0;
+    bool stop = false;
+
+    std::vector<std::thread> threads;
+};
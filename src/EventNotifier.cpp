@@ -0,0 +1,273 @@
+//
+//  BMD memory
+//
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "EventNotifier.h"
+#include "Log.h"
+
+EventNotifier::EventNotifier(const std::string& pSocketPath):
+    socketPath(pSocketPath)
+{
+}
+
+EventNotifier::~EventNotifier()
+{
+#if defined(__linux__)
+    if (notifierThread.joinable())
+    {
+        uint64_t value = 1;
+        if (write(stopFd, &value, sizeof(value)) == -1)
+        {
+            Log(Log::Level::ERR) << "Failed to stop event notifier";
+        }
+
+        notifierThread.join();
+    }
+
+    for (const Reader& reader : readers)
+    {
+        close(reader.socketFd);
+        if (reader.eventFd != -1) close(reader.eventFd);
+    }
+
+    if (stopFd != -1) close(stopFd);
+
+    if (listenFd != -1)
+    {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+#endif
+}
+
+bool EventNotifier::start()
+{
+#if defined(__linux__)
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (socketPath.length() >= sizeof(address.sun_path))
+    {
+        Log(Log::Level::ERR) << "Event socket path too long";
+        return false;
+    }
+
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    unlink(socketPath.c_str());
+
+    if ((listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to create event socket";
+        return false;
+    }
+
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to bind event socket " << socketPath;
+        return false;
+    }
+
+    if (listen(listenFd, 16) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to listen on event socket";
+        return false;
+    }
+
+    if ((stopFd = eventfd(0, EFD_CLOEXEC)) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to create eventfd";
+        return false;
+    }
+
+    notifierThread = std::thread(&EventNotifier::run, this);
+
+    Log(Log::Level::INFO) << "Event socket: " << socketPath;
+
+    return true;
+#else
+    Log(Log::Level::ERR) << "Event notifications are only supported on Linux";
+    return false;
+#endif
+}
+
+void EventNotifier::notify(uint32_t event)
+{
+#if defined(__linux__)
+    std::lock_guard<std::mutex> lock(readerMutex);
+
+    for (const Reader& reader : readers)
+    {
+        if (reader.eventFd != -1 && (reader.events & event))
+        {
+            // the eventfd is non-blocking, a reader that does not drain it just stays signalled
+            uint64_t value = 1;
+            if (write(reader.eventFd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+            {
+                Log(Log::Level::WARN) << "Failed to signal eventfd";
+            }
+        }
+    }
+#else
+    (void)event;
+#endif
+}
+
+void EventNotifier::run()
+{
+#if defined(__linux__)
+    std::vector<pollfd> pollFds;
+
+    for (;;)
+    {
+        pollFds.clear();
+        pollFds.push_back({ stopFd, POLLIN, 0 });
+        pollFds.push_back({ listenFd, POLLIN, 0 });
+
+        {
+            std::lock_guard<std::mutex> lock(readerMutex);
+
+            for (const Reader& reader : readers)
+            {
+                pollFds.push_back({ reader.socketFd, POLLIN, 0 });
+            }
+        }
+
+        if (poll(pollFds.data(), pollFds.size(), -1) == -1)
+        {
+            if (errno == EINTR) continue;
+
+            Log(Log::Level::ERR) << "Failed to poll event socket";
+            return;
+        }
+
+        if (pollFds[0].revents)
+        {
+            return;
+        }
+
+        if (pollFds[1].revents & POLLIN)
+        {
+            Reader reader;
+
+            if ((reader.socketFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC)) == -1)
+            {
+                Log(Log::Level::WARN) << "Failed to accept event socket connection";
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(readerMutex);
+                readers.push_back(reader);
+            }
+        }
+
+        for (size_t i = 2; i < pollFds.size(); ++i)
+        {
+            if (!pollFds[i].revents) continue;
+
+            // the registration message is the mask of events the reader wants to be signalled for
+            uint32_t events = 0;
+            ssize_t size = recv(pollFds[i].fd, &events, sizeof(events), MSG_DONTWAIT);
+
+            if (size <= 0)
+            {
+                removeReader(pollFds[i].fd);
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(readerMutex);
+
+            for (Reader& reader : readers)
+            {
+                if (reader.socketFd == pollFds[i].fd)
+                {
+                    reader.events = events ? events : (VIDEO | AUDIO | FORMAT);
+
+                    if (reader.eventFd == -1 && !registerReader(reader))
+                    {
+                        reader.events = 0;
+                    }
+
+                    break;
+                }
+            }
+        }
+    }
+#endif
+}
+
+bool EventNotifier::registerReader(Reader& reader)
+{
+#if defined(__linux__)
+    if ((reader.eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to create eventfd";
+        return false;
+    }
+
+    // the reply carries the granted event mask and the eventfd itself
+    iovec vector;
+    vector.iov_base = &reader.events;
+    vector.iov_len = sizeof(reader.events);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr* controlMessage = CMSG_FIRSTHDR(&message);
+    controlMessage->cmsg_level = SOL_SOCKET;
+    controlMessage->cmsg_type = SCM_RIGHTS;
+    controlMessage->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(controlMessage), &reader.eventFd, sizeof(int));
+
+    if (sendmsg(reader.socketFd, &message, MSG_NOSIGNAL) == -1)
+    {
+        Log(Log::Level::WARN) << "Failed to send eventfd to reader";
+        close(reader.eventFd);
+        reader.eventFd = -1;
+        return false;
+    }
+
+    Log(Log::Level::INFO) << "Reader registered for events " << reader.events;
+
+    return true;
+#else
+    (void)reader;
+    return false;
+#endif
+}
+
+void EventNotifier::removeReader(int socketFd)
+{
+    std::lock_guard<std::mutex> lock(readerMutex);
+
+    for (auto i = readers.begin(); i != readers.end(); ++i)
+    {
+        if (i->socketFd == socketFd)
+        {
+            close(i->socketFd);
+            if (i->eventFd != -1) close(i->eventFd);
+
+            readers.erase(i);
+
+            Log(Log::Level::INFO) << "Reader disconnected";
+            break;
+        }
+    }
+}
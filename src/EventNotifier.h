@@ -0,0 +1,49 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// hands out eventfds over a Unix domain socket and signals them when new data is published
+class EventNotifier
+{
+public:
+    enum Event: uint32_t
+    {
+        VIDEO = 0x01,
+        AUDIO = 0x02,
+        FORMAT = 0x04
+    };
+
+    EventNotifier(const std::string& pSocketPath);
+    virtual ~EventNotifier();
+
+    bool start();
+    void notify(uint32_t event);
+
+protected:
+    struct Reader
+    {
+        int socketFd = -1;
+        int eventFd = -1;
+        uint32_t events = 0;
+    };
+
+    void run();
+    bool registerReader(Reader& reader);
+    void removeReader(int socketFd);
+
+    std::string socketPath;
+    int listenFd = -1;
+    int stopFd = -1;
+
+    std::thread notifierThread;
+    std::mutex readerMutex;
+    std::vector<Reader> readers;
+};
@@ -0,0 +1,178 @@
+//
+//  BMD memory
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "FrameCopy.h"
+#include "Log.h"
+
+static void copyMemcpy(void* destination, const void* source, size_t size)
+{
+    memcpy(destination, source, size);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// copies the bytes in front of the first aligned destination address with memcpy, returns their count
+static size_t copyHead(uint8_t* destination, const uint8_t* source, size_t size, size_t alignment)
+{
+    size_t head = (alignment - (reinterpret_cast<uintptr_t>(destination) & (alignment - 1))) & (alignment - 1);
+    if (head > size) head = size;
+
+    memcpy(destination, source, head);
+
+    return head;
+}
+
+__attribute__((target("sse2")))
+static void copySSE2(void* destination, const void* source, size_t size)
+{
+    uint8_t* dst = static_cast<uint8_t*>(destination);
+    const uint8_t* src = static_cast<const uint8_t*>(source);
+
+    size_t head = copyHead(dst, src, size, 16);
+    dst += head; src += head; size -= head;
+
+    for (; size >= 64; size -= 64, src += 64, dst += 64)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst), a);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+    }
+
+    // streaming stores are weakly ordered, they have to be visible before the frame is published
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+
+__attribute__((target("avx2")))
+static void copyAVX2(void* destination, const void* source, size_t size)
+{
+    uint8_t* dst = static_cast<uint8_t*>(destination);
+    const uint8_t* src = static_cast<const uint8_t*>(source);
+
+    size_t head = copyHead(dst, src, size, 32);
+    dst += head; src += head; size -= head;
+
+    for (; size >= 128; size -= 128, src += 128, dst += 128)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 64));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 96));
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst), a);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 32), b);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 64), c);
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + 96), d);
+    }
+
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+
+__attribute__((target("avx512f")))
+static void copyAVX512(void* destination, const void* source, size_t size)
+{
+    uint8_t* dst = static_cast<uint8_t*>(destination);
+    const uint8_t* src = static_cast<const uint8_t*>(source);
+
+    size_t head = copyHead(dst, src, size, 64);
+    dst += head; src += head; size -= head;
+
+    for (; size >= 256; size -= 256, src += 256, dst += 256)
+    {
+        __m512i a = _mm512_loadu_si512(src);
+        __m512i b = _mm512_loadu_si512(src + 64);
+        __m512i c = _mm512_loadu_si512(src + 128);
+        __m512i d = _mm512_loadu_si512(src + 192);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst), a);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + 64), b);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + 128), c);
+        _mm512_stream_si512(reinterpret_cast<__m512i*>(dst + 192), d);
+    }
+
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+#endif
+
+std::vector<FrameCopy::Kernel> FrameCopy::getKernels()
+{
+    std::vector<Kernel> kernels;
+
+    kernels.push_back({ "memcpy", copyMemcpy });
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2")) kernels.push_back({ "sse2", copySSE2 });
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({ "avx2", copyAVX2 });
+    if (__builtin_cpu_supports("avx512f")) kernels.push_back({ "avx512", copyAVX512 });
+#endif
+
+    return kernels;
+}
+
+FrameCopy::Kernel FrameCopy::getKernel(const std::string& name)
+{
+    std::vector<Kernel> kernels = getKernels();
+
+    if (name.empty()) return kernels.back();
+
+    for (const Kernel& kernel : kernels)
+    {
+        if (name == kernel.name) return kernel;
+    }
+
+    return { nullptr, nullptr };
+}
+
+void FrameCopy::benchmark(size_t size, uint32_t iterations)
+{
+    // page aligned like the video slots, but the source is not, like the frames the SDK hands over
+    void* source;
+    void* destination;
+
+    if (posix_memalign(&source, 4096, size + 64) != 0) return;
+
+    if (posix_memalign(&destination, 4096, size) != 0)
+    {
+        free(source);
+        return;
+    }
+
+    memset(source, 1, size + 64);
+    memset(destination, 0, size);
+
+    for (const Kernel& kernel : getKernels())
+    {
+        kernel.function(destination, static_cast<uint8_t*>(source) + 32, size); // warm up
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (uint32_t i = 0; i < iterations; ++i)
+        {
+            kernel.function(destination, static_cast<uint8_t*>(source) + 32, size);
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        Log(Log::Level::INFO) << kernel.name << ": " << static_cast<double>(size) * iterations / seconds / 1e9 << " GB/s";
+    }
+
+    free(destination);
+    free(source);
+}
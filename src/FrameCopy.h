@@ -0,0 +1,32 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// copies frame payloads to the shared memory, the streaming store kernels bypass the cache of the writer
+class FrameCopy
+{
+public:
+    typedef void (*Function)(void* destination, const void* source, size_t size);
+
+    struct Kernel
+    {
+        const char* name;
+        Function function;
+    };
+
+    // kernels the CPU supports, memcpy first and the widest last
+    static std::vector<Kernel> getKernels();
+
+    // the widest supported kernel if the name is empty, a kernel with null members if it is not supported
+    static Kernel getKernel(const std::string& name);
+
+    // logs the throughput of every supported kernel
+    static void benchmark(size_t size, uint32_t iterations);
+};
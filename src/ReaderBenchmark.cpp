@@ -0,0 +1,238 @@
+//
+//  BMD memory
+//
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ReaderBenchmark.h"
+#include "bmdmemory/layout.h"
+#include "bmdmemory/reader_c.h"
+#include "Log.h"
+
+// the same layout the writer uses, with a single page per region
+struct Segment
+{
+    uint8_t* memory = nullptr;
+    size_t size = 0;
+    uint32_t slotCount = 4;
+    uint64_t indexOffset = 0;
+    uint64_t slotsOffset = 0;
+    uint64_t slotSize = 0;
+    uint64_t sequence = 0;
+};
+
+static uint64_t roundUp(uint64_t size, uint64_t pageSize)
+{
+    return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+static bool createSegment(const std::string& name, uint32_t width, uint32_t height, Segment& segment)
+{
+    uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint32_t stride = width * 2; // 8-bit YUV
+    uint64_t dataSize = static_cast<uint64_t>(stride) * height;
+
+    uint64_t metaDataOffset = roundUp(sizeof(bmdmemory::Header), pageSize);
+    segment.indexOffset = metaDataOffset + pageSize;
+    segment.slotsOffset = segment.indexOffset + roundUp(segment.slotCount * sizeof(bmdmemory::IndexEntry), pageSize);
+    segment.slotSize = pageSize + roundUp(dataSize, pageSize);
+    uint64_t audioDataOffset = segment.slotsOffset + segment.slotCount * segment.slotSize;
+    segment.size = static_cast<size_t>(audioDataOffset + pageSize);
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+
+    if (fd == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to create shared memory " << name;
+        return false;
+    }
+
+    if (ftruncate(fd, static_cast<off_t>(segment.size)) == -1)
+    {
+        Log(Log::Level::ERR) << "Failed to resize shared memory";
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    void* sharedMemory = mmap(nullptr, segment.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (sharedMemory == MAP_FAILED)
+    {
+        Log(Log::Level::ERR) << "Failed to map shared memory";
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    segment.memory = static_cast<uint8_t*>(sharedMemory);
+
+    bmdmemory::Header* header = reinterpret_cast<bmdmemory::Header*>(segment.memory);
+    header->version = bmdmemory::LAYOUT_VERSION;
+    header->size = segment.size;
+    header->headerSize = static_cast<uint32_t>(sizeof(bmdmemory::Header));
+    header->pageSize = static_cast<uint32_t>(pageSize);
+    header->numaNode = -1;
+    header->latestFrame.slotsOffset = segment.slotsOffset + pageSize - sizeof(bmdmemory::VideoRecord);
+    header->latestFrame.slotSize = segment.slotSize;
+
+    bmdmemory::MetaDataRecord* metaData = reinterpret_cast<bmdmemory::MetaDataRecord*>(segment.memory + metaDataOffset);
+    metaData->sequence = 1;
+    metaData->width = width;
+    metaData->height = height;
+    metaData->frameDuration = 1001;
+    metaData->timeScale = 60000;
+    metaData->fieldDominance = 3;
+    metaData->videoSlotCount = segment.slotCount;
+    metaData->videoSlotSize = static_cast<uint32_t>(segment.slotSize);
+    metaData->videoIndexOffset = segment.indexOffset;
+    metaData->videoSlotsOffset = segment.slotsOffset;
+    metaData->audioDataOffset = audioDataOffset;
+    metaData->audioDataSize = pageSize;
+    metaData->generation.store(2, std::memory_order_release);
+
+    header->metaData.offset.store(metaDataOffset, std::memory_order_relaxed);
+    header->metaData.sequence.store(1, std::memory_order_release);
+
+    for (uint32_t slot = 0; slot < segment.slotCount; ++slot)
+    {
+        uint8_t* data = segment.memory + segment.slotsOffset + slot * segment.slotSize + pageSize;
+        memset(data, static_cast<int>(slot + 1), dataSize);
+
+        bmdmemory::VideoRecord* record = reinterpret_cast<bmdmemory::VideoRecord*>(data - sizeof(bmdmemory::VideoRecord));
+        record->width = width;
+        record->height = height;
+        record->stride = stride;
+        record->dataSize = static_cast<uint32_t>(dataSize);
+    }
+
+    header->magic.store(bmdmemory::LAYOUT_MAGIC, std::memory_order_release);
+
+    return true;
+}
+
+// what the writer does after a frame has landed in a slot
+static void publishFrame(Segment& segment)
+{
+    bmdmemory::Header* header = reinterpret_cast<bmdmemory::Header*>(segment.memory);
+    uint64_t sequence = ++segment.sequence;
+    uint64_t offset = segment.slotsOffset + (sequence % segment.slotCount) * segment.slotSize + header->pageSize - sizeof(bmdmemory::VideoRecord);
+
+    bmdmemory::VideoRecord* record = reinterpret_cast<bmdmemory::VideoRecord*>(segment.memory + offset);
+
+    record->generation.store(record->generation.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    record->sequence = sequence;
+    record->timestamp = sequence * 1001;
+    record->duration = 1001;
+
+    record->generation.store(record->generation.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+    bmdmemory::IndexEntry& entry = reinterpret_cast<bmdmemory::IndexEntry*>(segment.memory + segment.indexOffset)[sequence % segment.slotCount];
+    entry.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.offset = offset;
+    entry.timestamp = record->timestamp;
+    entry.sequence.store(sequence, std::memory_order_release);
+
+    header->video.offset.store(offset, std::memory_order_relaxed);
+    header->video.sequence.store(sequence, std::memory_order_release);
+    header->latestFrame.descriptor.store(((sequence % segment.slotCount) << bmdmemory::LATEST_FRAME_SEQUENCE_BITS) | sequence,
+                                         std::memory_order_release);
+    header->frameCounter.fetch_add(1, std::memory_order_seq_cst);
+}
+
+bool ReaderBenchmark::run(const std::string& name, uint32_t frameCount)
+{
+    static const struct
+    {
+        uint32_t width;
+        uint32_t height;
+    } formats[] = { { 1920, 1080 }, { 3840, 2160 } };
+
+    enum Style
+    {
+        NEXT, // a NumPy array over the frame, without touching the pixels
+        LATEST,
+        NEXT_READ, // reading every pixel in place
+        NEXT_COPY, // copying the frame out before reading the copy, like unpacking the segment by hand did
+        STYLE_COUNT
+    };
+
+    static const char* styleNames[STYLE_COUNT] = { "next", "latest", "next and read in place", "next and copy" };
+
+    for (const auto& format : formats)
+    {
+        Segment segment;
+
+        if (!createSegment(name, format.width, format.height, segment)) return false;
+
+        bmdmemory_reader* reader = bmdmemory_reader_open(name.c_str(), bmdmemory::STREAM_VIDEO);
+
+        if (!bmdmemory_reader_is_open(reader))
+        {
+            Log(Log::Level::ERR) << bmdmemory_reader_get_error(reader);
+            bmdmemory_reader_close(reader);
+            munmap(segment.memory, segment.size);
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        std::vector<uint8_t> buffer(static_cast<size_t>(format.width) * 2 * format.height);
+        uint64_t checksum = 0;
+
+        for (uint32_t style = 0; style < STYLE_COUNT; ++style)
+        {
+            uint32_t validFrames = 0;
+            auto start = std::chrono::steady_clock::now();
+
+            for (uint32_t i = 0; i < frameCount; ++i)
+            {
+                publishFrame(segment);
+
+                bmdmemory_frame frame;
+
+                if (!((style == LATEST) ?
+                      bmdmemory_reader_latest_frame(reader, &frame, 0) :
+                      bmdmemory_reader_next_frame(reader, &frame, 0))) continue;
+
+                if (style == NEXT_READ || style == NEXT_COPY)
+                {
+                    const uint8_t* pixels = frame.data;
+
+                    if (style == NEXT_COPY)
+                    {
+                        memcpy(buffer.data(), frame.data, frame.data_size);
+                        pixels = buffer.data();
+                    }
+
+                    // the same pass over every pixel either way, so that only the copy makes the difference
+                    const uint64_t* data = reinterpret_cast<const uint64_t*>(pixels);
+
+                    for (size_t word = 0; word < frame.data_size / sizeof(uint64_t); ++word) checksum += data[word];
+                }
+
+                if (bmdmemory_reader_frame_valid(&frame)) ++validFrames;
+            }
+
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            Log(Log::Level::INFO) << format.width << "x" << format.height << " " << styleNames[style] << ": " <<
+                validFrames / seconds << " fps";
+        }
+
+        bmdmemory_reader_close(reader);
+        munmap(segment.memory, segment.size);
+        shm_unlink(name.c_str());
+
+        // keeps the reads from being optimized away
+        if (checksum == 0) Log(Log::Level::INFO) << "Empty frames";
+    }
+
+    return true;
+}
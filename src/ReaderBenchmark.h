@@ -0,0 +1,16 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// publishes synthetic frames to a segment of its own and reads them through the C interface of the reader library
+class ReaderBenchmark
+{
+public:
+    // logs the frames per second of every access style at 1080p and UHD
+    static bool run(const std::string& name, uint32_t frameCount);
+};
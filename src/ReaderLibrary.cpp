@@ -0,0 +1,193 @@
+//
+//  BMD memory
+//
+
+#include "bmdmemory/reader.h"
+#include "bmdmemory/reader_c.h"
+
+struct bmdmemory_reader
+{
+    bmdmemory::Reader reader;
+};
+
+static std::chrono::nanoseconds getTimeout(int64_t timeout)
+{
+    return (timeout < 0) ? std::chrono::nanoseconds::max() : std::chrono::nanoseconds(timeout);
+}
+
+static void copyFrame(const bmdmemory::Reader::Frame& source, bmdmemory_frame* frame)
+{
+    frame->data = source.getData();
+    frame->data_size = source.getDataSize();
+    frame->width = source.getWidth();
+    frame->height = source.getHeight();
+    frame->stride = source.getStride();
+    frame->sequence = source.getSequence();
+    frame->timestamp = source.getTimestamp();
+    frame->duration = source.getDuration();
+    frame->flags = source.getFlags();
+    frame->hardware_timestamp = source.getHardwareTimestamp();
+    frame->arrival_time = source.getArrivalTime();
+    frame->arrival_real_time = source.getArrivalRealTime();
+    frame->generation = source.getGeneration();
+}
+
+static void copyAudioPacket(const bmdmemory::Reader::AudioPacket& source, bmdmemory_audio_packet* packet)
+{
+    packet->data = source.getData();
+    packet->data_size = source.getDataSize();
+    packet->sample_frame_count = source.getSampleFrameCount();
+    packet->sequence = source.getSequence();
+    packet->timestamp = source.getTimestamp();
+    packet->hardware_timestamp = source.getHardwareTimestamp();
+    packet->arrival_time = source.getArrivalTime();
+    packet->arrival_real_time = source.getArrivalRealTime();
+    packet->generation = source.getGeneration();
+    packet->flags = source.getFlags();
+    packet->reserved = 0;
+}
+
+// the record header is stored right in front of the data
+template <class T>
+static int isValid(const uint8_t* data, uint64_t generation)
+{
+    if (!data) return 0;
+
+    const T* record = reinterpret_cast<const T*>(data - sizeof(T));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return record->generation.load(std::memory_order_relaxed) == generation;
+}
+
+bmdmemory_reader* bmdmemory_reader_open(const char* name, uint32_t streams)
+{
+    bmdmemory_reader* reader = new bmdmemory_reader();
+    reader->reader.open(name, streams);
+
+    return reader;
+}
+
+void bmdmemory_reader_close(bmdmemory_reader* reader)
+{
+    delete reader;
+}
+
+const char* bmdmemory_reader_get_error(const bmdmemory_reader* reader)
+{
+    return reader->reader.getError().c_str();
+}
+
+int bmdmemory_reader_is_open(const bmdmemory_reader* reader)
+{
+    return reader->reader.isOpen();
+}
+
+int bmdmemory_reader_get_format(const bmdmemory_reader* reader, bmdmemory_format* format)
+{
+    if (!reader->reader.isOpen()) return 0;
+
+    bmdmemory::Reader::Format result;
+
+    if (!reader->reader.getFormat(result)) return 0;
+
+    format->sequence = result.sequence;
+    format->pixel_format = result.pixelFormat;
+    format->width = result.width;
+    format->height = result.height;
+    format->frame_duration = result.frameDuration;
+    format->time_scale = result.timeScale;
+    format->field_dominance = result.fieldDominance;
+    format->audio_sample_rate = result.audioSampleRate;
+    format->audio_sample_depth = result.audioSampleDepth;
+    format->audio_channels = result.audioChannels;
+
+    return 1;
+}
+
+int bmdmemory_reader_next_frame(bmdmemory_reader* reader, bmdmemory_frame* frame, int64_t timeout)
+{
+    if (!reader->reader.isOpen()) return 0;
+
+    bmdmemory::Reader::Frame result;
+
+    if (!(timeout ? reader->reader.nextFrame(result, getTimeout(timeout)) : reader->reader.nextFrame(result))) return 0;
+
+    copyFrame(result, frame);
+
+    return 1;
+}
+
+int bmdmemory_reader_latest_frame(bmdmemory_reader* reader, bmdmemory_frame* frame, int64_t timeout)
+{
+    if (!reader->reader.isOpen()) return 0;
+
+    bmdmemory::Reader::Frame result;
+
+    if (!(timeout ? reader->reader.latestFrame(result, getTimeout(timeout)) : reader->reader.latestFrame(result))) return 0;
+
+    copyFrame(result, frame);
+
+    return 1;
+}
+
+int bmdmemory_reader_frame_valid(const bmdmemory_frame* frame)
+{
+    return isValid<bmdmemory::VideoRecord>(frame->data, frame->generation);
+}
+
+int bmdmemory_reader_find_frame(bmdmemory_reader* reader, bmdmemory_frame* frame, uint64_t timestamp, int hardware)
+{
+    if (!reader->reader.isOpen()) return 0;
+
+    bmdmemory::Reader::Frame result;
+
+    if (!reader->reader.findFrame(timestamp, result, hardware ? bmdmemory::Reader::HARDWARE_TIME : bmdmemory::Reader::STREAM_TIME)) return 0;
+
+    copyFrame(result, frame);
+
+    return 1;
+}
+
+int bmdmemory_reader_next_audio_packet(bmdmemory_reader* reader, bmdmemory_audio_packet* packet, int64_t timeout)
+{
+    if (!reader->reader.isOpen()) return 0;
+
+    bmdmemory::Reader::AudioPacket result;
+
+    if (!(timeout ? reader->reader.nextAudioPacket(result, getTimeout(timeout)) : reader->reader.nextAudioPacket(result))) return 0;
+
+    copyAudioPacket(result, packet);
+
+    return 1;
+}
+
+int bmdmemory_reader_latest_audio_packet(bmdmemory_reader* reader, bmdmemory_audio_packet* packet, int64_t timeout)
+{
+    if (!reader->reader.isOpen()) return 0;
+
+    bmdmemory::Reader::AudioPacket result;
+
+    if (!(timeout ? reader->reader.latestAudioPacket(result, getTimeout(timeout)) : reader->reader.latestAudioPacket(result))) return 0;
+
+    copyAudioPacket(result, packet);
+
+    return 1;
+}
+
+int bmdmemory_reader_audio_packet_valid(const bmdmemory_audio_packet* packet)
+{
+    return isValid<bmdmemory::AudioRecord>(packet->data, packet->generation);
+}
+
+int bmdmemory_reader_find_audio_packet(bmdmemory_reader* reader, bmdmemory_audio_packet* packet, uint64_t timestamp)
+{
+    if (!reader->reader.isOpen()) return 0;
+
+    bmdmemory::Reader::AudioPacket result;
+
+    if (!reader->reader.findAudioPacket(timestamp, result)) return 0;
+
+    copyAudioPacket(result, packet);
+
+    return 1;
+}
@@ -0,0 +1,67 @@
+//
+//  BMD memory
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// bounded lock-free queue for exactly one producer thread and one consumer thread
+template <typename T>
+class SPSCQueue
+{
+public:
+    explicit SPSCQueue(uint32_t pCapacity):
+        items(pCapacity)
+    {
+    }
+
+    // called by the producer, returns false if the queue is full
+    bool push(const T& item)
+    {
+        uint64_t currentTail = tail.load(std::memory_order_relaxed);
+
+        if (currentTail - head.load(std::memory_order_acquire) >= items.size()) return false;
+
+        items[currentTail % items.size()] = item;
+        tail.store(currentTail + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // called by the consumer, returns false if the queue is empty
+    bool pop(T& item)
+    {
+        uint64_t currentHead = head.load(std::memory_order_relaxed);
+
+        if (currentHead == tail.load(std::memory_order_acquire)) return false;
+
+        item = items[currentHead % items.size()];
+        head.store(currentHead + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // may be called from either thread
+    uint32_t size() const
+    {
+        uint64_t currentHead = head.load(std::memory_order_acquire);
+        uint64_t currentTail = tail.load(std::memory_order_acquire);
+
+        return static_cast<uint32_t>(currentTail > currentHead ? currentTail - currentHead : 0);
+    }
+
+    uint32_t capacity() const { return static_cast<uint32_t>(items.size()); }
+
+private:
+    // the producer and the consumer write to different cache lines
+    std::atomic<uint64_t> head{0};
+    uint8_t headPadding[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> tail{0};
+    uint8_t tailPadding[64 - sizeof(std::atomic<uint64_t>)];
+
+    std::vector<T> items;
+};
@@ -12,7 +12,10 @@
 #include <fcntl.h>
 #include "Constants.h"
 #include "BMDMemory.h"
+#include "bmdmemory/reader.h"
+#include "FrameCopy.h"
 #include "Log.h"
+#include "ReaderBenchmark.h"
 
 static void signalHandler(int signo)
 {
@@ -128,6 +131,60 @@ static int killDaemon(const char* lockFile)
     return pid;
 }
 
+// prints the latency histograms of a running bmdmemory
+static bool printStats(const std::string& name)
+{
+    bmdmemory::Reader reader;
+
+    if (!reader.open(name, 0))
+    {
+        Log(Log::Level::ERR) << reader.getError();
+        return false;
+    }
+
+    const bmdmemory::Header* header = reader.getHeader();
+
+    static const char* metricNames[bmdmemory::LATENCY_METRIC_COUNT] = { "queue", "copy", "publish", "jitter" };
+
+    for (uint32_t stream = 0; stream < 2; ++stream)
+    {
+        const bmdmemory::LatencyHistogram* histograms = (stream == 0) ? header->stats.video : header->stats.audio;
+
+        for (uint32_t metric = 0; metric < bmdmemory::LATENCY_METRIC_COUNT; ++metric)
+        {
+            const bmdmemory::LatencyHistogram& histogram = histograms[metric];
+
+            // microseconds
+            Log(Log::Level::INFO) << ((stream == 0) ? "video " : "audio ") << metricNames[metric] <<
+                ": count: " << histogram.count.load(std::memory_order_relaxed) <<
+                ", p50: " << bmdmemory::getLatencyPercentile(histogram, 0.5) / 1000.0 << " us" <<
+                ", p99: " << bmdmemory::getLatencyPercentile(histogram, 0.99) / 1000.0 << " us" <<
+                ", p999: " << bmdmemory::getLatencyPercentile(histogram, 0.999) / 1000.0 << " us" <<
+                ", max: " << histogram.max.load(std::memory_order_relaxed) / 1000.0 << " us";
+        }
+    }
+
+    return true;
+}
+
+// parses a size in bytes with an optional K, M or G suffix
+static uint64_t parseSize(const char* str)
+{
+    char* end;
+    uint64_t size = strtoull(str, &end, 10);
+
+    switch (*end)
+    {
+        case 'K': case 'k': size *= 1024ULL; break;
+        case 'M': case 'm': size *= 1024ULL * 1024ULL; break;
+        case 'G': case 'g': size *= 1024ULL * 1024ULL * 1024ULL; break;
+        case '\0': break;
+        default: Log(Log::Level::ERR) << "Invalid size " << str; break;
+    }
+
+    return size;
+}
+
 int main(int argc, const char* argv[])
 {
     if (argc < 2)
@@ -135,7 +192,7 @@ int main(int argc, const char* argv[])
         Log(Log::Level::ERR) << "Too few arguments";
 
         const char* exe = argc >= 1 ? argv[0] : "bmdmemory";
-        Log(Log::Level::INFO) << "Usage: " << exe << " <name> [--instance=<instance>] [--video_mode <video mode>] [--video_connection <video connection>] [--video_format <video format>] [--audio_connection <audio connection>] [--memory_size <memory size>] [--daemon] [--kill-daemon]";
+        Log(Log::Level::INFO) << "Usage: " << exe << " <name> [--instance=<instance>] [--video_mode <video mode>] [--video_connection <video connection>] [--video_format <video format>] [--audio_connection <audio connection>] [--video_slots <video slots>] [--history <milliseconds>] [--audio_size <audio size>] [--event_socket <socket path>] [--reader_policy <reader policy>] [--overflow_frames <overflow frames>] [--memory_size <memory size>] [--huge_pages <huge pages>] [--huge_pages_path <hugetlbfs mount>] [--numa_node <numa node>] [--copy_kernel <memcpy|sse2|avx2|avx512>] [--copy_threads <copy threads>] [--writer_queue <writer queue size>] [--rt_priority <priority>] [--cpu_affinity <cpu list>] [--benchmark_copy] [--benchmark_callback] [--benchmark_reader] [--stats] [--daemon] [--kill-daemon]";
 
         return 1;
     }
@@ -147,6 +204,21 @@ int main(int argc, const char* argv[])
     int32_t videoConnection = 0;
     int32_t videoFormat = 0;
     int32_t audioConnection = 0;
+    uint32_t videoSlotCount = 0;
+    uint32_t historyDuration = 0;
+    uint64_t audioDataSize = 0;
+    uint64_t memorySize = 0;
+    std::string eventSocketPath;
+    BMDMemory::ReaderPolicy readerPolicy = BMDMemory::ReaderPolicy::NONE;
+    uint32_t overflowQueueSize = 8;
+    BMDMemory::HugePages hugePages = BMDMemory::HugePages::NONE;
+    std::string hugePagesPath;
+    int32_t numaNode = -1;
+    std::string copyKernel;
+    uint32_t copyThreadCount = 4;
+    uint32_t writerQueueSize = 16;
+    int32_t rtPriority = 0;
+    std::string cpuAffinity;
     bool daemon = false;
 
     for (int i = 2; i < argc; ++i)
@@ -186,6 +258,147 @@ int main(int argc, const char* argv[])
             else
                 Log(Log::Level::ERR) << "Invalid argument";
         }
+        else if (strcmp(argv[i], "--video_slots") == 0)
+        {
+            if (++i < argc)
+                videoSlotCount = static_cast<uint32_t>(atoi(argv[i]));
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--history") == 0)
+        {
+            if (++i < argc)
+                historyDuration = static_cast<uint32_t>(atoi(argv[i]));
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--audio_size") == 0)
+        {
+            if (++i < argc)
+                audioDataSize = parseSize(argv[i]);
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--memory_size") == 0)
+        {
+            if (++i < argc)
+                memorySize = parseSize(argv[i]);
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--event_socket") == 0)
+        {
+            if (++i < argc)
+                eventSocketPath = argv[i];
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--reader_policy") == 0)
+        {
+            if (++i < argc)
+            {
+                switch (atoi(argv[i]))
+                {
+                    case 0: readerPolicy = BMDMemory::ReaderPolicy::NONE; break;
+                    case 1: readerPolicy = BMDMemory::ReaderPolicy::DROP; break;
+                    case 2: readerPolicy = BMDMemory::ReaderPolicy::BACKPRESSURE; break;
+                    default: Log(Log::Level::ERR) << "Invalid reader policy"; break;
+                }
+            }
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--overflow_frames") == 0)
+        {
+            if (++i < argc)
+                overflowQueueSize = static_cast<uint32_t>(atoi(argv[i]));
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--huge_pages") == 0)
+        {
+            if (++i < argc)
+            {
+                switch (atoi(argv[i]))
+                {
+                    case 0: hugePages = BMDMemory::HugePages::NONE; break;
+                    case 1: hugePages = BMDMemory::HugePages::TRANSPARENT; break;
+                    case 2: hugePages = BMDMemory::HugePages::HUGETLBFS; break;
+                    default: Log(Log::Level::ERR) << "Invalid huge pages mode"; break;
+                }
+            }
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--huge_pages_path") == 0)
+        {
+            if (++i < argc)
+                hugePagesPath = argv[i];
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--numa_node") == 0)
+        {
+            if (++i < argc)
+                numaNode = atoi(argv[i]);
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--copy_kernel") == 0)
+        {
+            if (++i < argc)
+                copyKernel = argv[i];
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--copy_threads") == 0)
+        {
+            if (++i < argc)
+                copyThreadCount = static_cast<uint32_t>(atoi(argv[i]));
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--writer_queue") == 0)
+        {
+            if (++i < argc)
+                writerQueueSize = static_cast<uint32_t>(atoi(argv[i]));
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--rt_priority") == 0)
+        {
+            if (++i < argc)
+                rtPriority = atoi(argv[i]);
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--cpu_affinity") == 0)
+        {
+            if (++i < argc)
+                cpuAffinity = argv[i];
+            else
+                Log(Log::Level::ERR) << "Invalid argument";
+        }
+        else if (strcmp(argv[i], "--benchmark_copy") == 0)
+        {
+            // a 10-bit UHD frame
+            FrameCopy::benchmark(((3840 + 47) / 48) * 128 * 2160, 100);
+            return EXIT_SUCCESS;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            return printStats(name) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else if (strcmp(argv[i], "--benchmark_callback") == 0)
+        {
+            BMDMemory::benchmarkCallback(10000000);
+            return EXIT_SUCCESS;
+        }
+        else if (strcmp(argv[i], "--benchmark_reader") == 0)
+        {
+            // the name is used for a segment of the benchmark's own, so it must not belong to a running bmdmemory
+            return ReaderBenchmark::run(name, 1000) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
         else if (strcmp(argv[i], "--daemon") == 0)
         {
             daemon = true;
@@ -219,7 +432,22 @@ int main(int argc, const char* argv[])
                         videoMode,
                         videoConnection,
                         videoFormat,
-                        audioConnection);
+                        audioConnection,
+                        videoSlotCount,
+                        historyDuration,
+                        audioDataSize,
+                        memorySize,
+                        eventSocketPath,
+                        readerPolicy,
+                        overflowQueueSize,
+                        hugePages,
+                        hugePagesPath,
+                        numaNode,
+                        copyKernel,
+                        copyThreadCount,
+                        writerQueueSize,
+                        rtPriority,
+                        cpuAffinity);
 
     if (!bmdMemory.run())
     {